@@ -1,5 +1,22 @@
 //Author: Sebastian Roskosch <Sebastian.Roskosch[at]bihealth.de>
 #include "BAMQC.h"
+#include "metrics.h"
+#include "parallel.h"
+
+#ifdef BAMQC_ALLOC_STATS
+//Count all allocations, reported after processing the records by wrapRunChecks().
+void * operator new(std::size_t size)
+{
+    ++allocationCounter();
+    if (void * ptr = std::malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void * ptr) noexcept
+{
+    std::free(ptr);
+}
+#endif
 
 int main(int argc, char const ** argv)
 {
@@ -12,47 +29,28 @@ int main(int argc, char const ** argv)
         return res == seqan::ArgumentParser::PARSE_ERROR;               //Terminate on parsing errors
     if (inputCheck(options))                                            //Terminate if check of parameters fails.
         return 1;
+    if (options.tee)                                                    //Standard output carries the BAM-file
+        std::cout.rdbuf(std::cerr.rdbuf());
     feedBack(options);
+    RefIdxMemory refIdxMemory;                                          //Indices of the reference kept in memory
+    if (options.conv && options.contextIndex && !prepareContextIndex(refIdxMemory, options))
+        options.contextIndex = false;                                   //Fall back to reading the reference
+    if (options.conv && options.packedReference && !preparePackedReference(refIdxMemory, options))
+        options.packedReference = false;
+    BamInput bamInput;
     BamFileIn bamFile;                                                  //Prepare and load BAM-file
-    if (!loadBAM(bamFile, options.inPath))
+    if (!loadBAM(bamFile, bamInput, options))
         return 1;
     BamHeader header;                                                   //Read header to get to right position in file
     readHeader(header, bamFile);
-    if (options.conv && options.insDist)                                //Perform both checks in one run  to reduce I/O
-    {
-        TInsertDistr InsertCounts = "";
-        resize(InsertCounts, options.maxInsert + 1, 0);
-        unsigned artifactConv [2][2] = {0};                              //table for all artifacual conversions
-        unsigned normalConv [2][2] = {0};                                //table for all non-artifactual conversions
-        if (!wrapDoAll(artifactConv, normalConv, InsertCounts, bamFile, options))
-            return 1;
-        if (!wrapOutputInserts(InsertCounts, options))
-            return 1;
-        if (!wrapOutputArtifacts(artifactConv, normalConv, options))
-            return 1;
-    }
+    bool ok = false;                                                    //Instantiate an engine for the selected checks
+    if (options.insDist && options.conv)
+        ok = wrapRunChecks<QCEngine<InsertSizeMetric, ConversionMetric> >(bamFile, refIdxMemory, options);
+    else if (options.insDist)
+        ok = wrapRunChecks<QCEngine<InsertSizeMetric> >(bamFile, refIdxMemory, options);
     else
-    {
-        if (options.insDist)                                            //Only InsertSize Distribution
-        {
-        TInsertDistr InsertCounts = "";
-        if (!wrapCountInsertSize(InsertCounts, bamFile, options))
-            return 1;
-        if (!wrapOutputInserts(InsertCounts, options))
-            return 1;
-        }
-        else if (options.conv)                                          //Only CCG > CAG or CGG > CTG Artifact check
-        {
-            FaiIndex faiIndex;
-            if (!loadRefIdx(faiIndex, toCString(options.refPath)))
-                return 1;
-            unsigned artifactConv [2][2] = {0};
-            unsigned normalConv [2][2] = {0};
-            if (!getArtifactCount(artifactConv, normalConv, bamFile, faiIndex, options))
-                return 1;
-            if (!wrapOutputArtifacts(artifactConv, normalConv, options))
-                return 1;
-        }
-    }
+        ok = wrapRunChecks<QCEngine<ConversionMetric> >(bamFile, refIdxMemory, options);
+    if (!closeBAM(bamFile, bamInput) || !ok)
+        return 1;
     return 0;
 }
\ No newline at end of file
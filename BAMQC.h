@@ -2,10 +2,18 @@
 #ifndef BAMQC_H_
 #define BAMQC_H_
 
+#include <cstring>
 #include <iostream>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <seqan/bam_io.h>
 #include <seqan/find.h>
 #include "parse.h"
+#include "context_index.h"
+#include "packed_reference.h"
 
 using namespace seqan;
 
@@ -25,168 +33,629 @@ inline bool checkRecord (const BamAlignmentRecord & record, const ProgramOptions
     else return true;
 }
 // ---------------------------------------------------------------------------------------
+// Function checkRecords()
+// ---------------------------------------------------------------------------------------
+//Flags of records rejected by checkRecord().
+const uint16_t REJECTED_FLAGS = BAM_FLAG_DUPLICATE | BAM_FLAG_QC_NO_PASS | BAM_FLAG_SECONDARY |
+                                BAM_FLAG_SUPPLEMENTARY | BAM_FLAG_UNMAPPED;
+//checkRecord() for the first size entries of the flag and mapQ columns of a batch. Sets valid[i] to 1 if record i
+//passes, to 0 otherwise. Checks 32 (AVX2) or 16 (SSE2) records at once.
+inline void checkRecords(String<uint8_t> & valid,
+                         const String<uint16_t> & flags,
+                         const String<uint8_t> & mapQs,
+                         unsigned size,
+                         const ProgramOptions & options)
+{
+    resize(valid, size);
+    uint8_t * out = begin(valid, Standard());
+    if (options.minMapQ > 255)                                  //No mapping quality is high enough
+    {
+        std::fill(out, out + size, 0);
+        return;
+    }
+    const uint16_t * flag = begin(flags, Standard());
+    const uint8_t * mapQ = begin(mapQs, Standard());
+    unsigned i = 0;
+#if defined(__AVX2__)
+    const __m256i rejected = _mm256_set1_epi16(REJECTED_FLAGS);
+    const __m256i minMapQ = _mm256_set1_epi8((char)options.minMapQ);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(flag + i));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(flag + i + 16));
+        lo = _mm256_cmpeq_epi16(_mm256_and_si256(lo, rejected), zero);
+        hi = _mm256_cmpeq_epi16(_mm256_and_si256(hi, rejected), zero);
+        __m256i flagOk = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);    //Packing works per lane
+        __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mapQ + i));
+        __m256i mapQOk = _mm256_cmpeq_epi8(_mm256_max_epu8(q, minMapQ), q);
+        __m256i passed = _mm256_and_si256(_mm256_and_si256(flagOk, mapQOk), one);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), passed);
+    }
+#elif defined(__SSE2__)
+    const __m128i rejected = _mm_set1_epi16(REJECTED_FLAGS);
+    const __m128i minMapQ = _mm_set1_epi8((char)options.minMapQ);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(flag + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(flag + i + 8));
+        lo = _mm_cmpeq_epi16(_mm_and_si128(lo, rejected), zero);
+        hi = _mm_cmpeq_epi16(_mm_and_si128(hi, rejected), zero);
+        __m128i flagOk = _mm_packs_epi16(lo, hi);
+        __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mapQ + i));
+        __m128i mapQOk = _mm_cmpeq_epi8(_mm_max_epu8(q, minMapQ), q);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_and_si128(_mm_and_si128(flagOk, mapQOk), one));
+    }
+#endif
+    for (; i < size; ++i)                                       //Remaining records
+        out[i] = (flag[i] & REJECTED_FLAGS) == 0 && mapQ[i] >= options.minMapQ;
+}
+// ---------------------------------------------------------------------------------------
+// Function readRecordCore()
+// ---------------------------------------------------------------------------------------
+//Read only the fixed-length fields of the next record of a BAM-file (rID, beginPos, mapQ, flag, tLen, ...) and skip
+//qName, cigar, seq, qual and tags without decoding them.
+inline void readRecordCore(BamAlignmentRecordCore & core, BamFileIn & bamFile)
+{
+    int32_t remainingBytes = 0;
+    readRawPod(remainingBytes, bamFile.iter);
+    readRawPod(core, bamFile.iter);
+    goFurther(bamFile.iter, remainingBytes - (int32_t)sizeof(BamAlignmentRecordCore));     //Skip by offset
+    String<unsigned> const & translateRefId = context(bamFile).translateFile2GlobalRefId;
+    if (core.rID >= 0 && !empty(translateRefId))
+        core.rID = translateRefId[core.rID];
+    if (core.rNextId >= 0 && !empty(translateRefId))
+        core.rNextId = translateRefId[core.rNextId];
+}
+//The variable-length members of record are left untouched. Falls back to readRecord() if the file is not in BAM
+//format.
+inline void readRecordCore(BamAlignmentRecord & record, BamFileIn & bamFile)
+{
+    if (!isEqual(format(bamFile), Bam()))
+        readRecord(record, bamFile);
+    else
+        readRecordCore(static_cast<BamAlignmentRecordCore &>(record), bamFile);
+}
+// ---------------------------------------------------------------------------------------
 // Insert-Size Distribution Functions
 // ---------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------
+// Function countTailInsert()
+// ---------------------------------------------------------------------------------------
+//Add an insert longer than options.maxInsert to its bucket in TInsertTail.
+inline void countTailInsert(TInsertTail & tail, uint32_t insertSize)
+{
+    unsigned bucket = getTailBucket(insertSize);
+    if (bucket >= length(tail))
+        resize(tail, bucket + 1, 0);
+    ++tail[bucket];
+}
+// ---------------------------------------------------------------------------------------
 // Function countInsertSize()
 // ---------------------------------------------------------------------------------------
 //Get Distance from leftmost base of first mate to rightmost base of right mate 
-//(template length) from one record and add it to counter in TInsertDistr
-inline int countInsertSize(TInsertDistr & counts, const BamAlignmentRecord & record, const ProgramOptions & options)
+//(template length) from one record and add it to counter in TInsertDistr, or in TInsertTail if it is longer than
+//options.maxInsert
+inline int countInsertSize(TInsertDistr & counts,
+                           TInsertTail & tail,
+                           const BamAlignmentRecord & record,
+                           const ProgramOptions & options)
 {
     int32_t insertSize = record.tLen;
-    if (insertSize >= 0 && insertSize <= options.maxInsert)
-    {
+    if (insertSize < 0)
+        return 1;           //return 1 if record was right mate (not counted)
+    if (insertSize <= options.maxInsert)
         ++counts[insertSize];                     //Increase counter
-        return 0;
-    }
-    else return 1;          //return 1 if record was right mate or longer than maxInsert (not counted)
+    else
+        countTailInsert(tail, insertSize);
+    return 0;
 }
 // ---------------------------------------------------------------------------------------
-// Function wrapCountInsertSize()
+// Function countInsertSizes()
 // ---------------------------------------------------------------------------------------
-//Wrapper for counting the insert sizes of the whole Bam-file
-inline bool wrapCountInsertSize(TInsertDistr & counts, BamFileIn & bamFile, ProgramOptions & options)
+//countInsertSize() for the first size entries of the tLen column of a batch, skipping records with valid[i] == 0.
+//The range checks are done for 8 (AVX2) or 4 (SSE2) records at once, only the counters are increased one by one.
+inline void countInsertSizes(TInsertDistr & counts,
+                             TInsertTail & tail,
+                             const String<int32_t> & tLens,
+                             const String<uint8_t> & valid,
+                             unsigned size,
+                             const ProgramOptions & options)
 {
-    resize(counts, options.maxInsert + 1, 0);
-    BamAlignmentRecord record;
-    try
+    const int32_t * tLen = begin(tLens, Standard());
+    const uint8_t * ok = begin(valid, Standard());
+    unsigned i = 0;
+#if defined(__AVX2__)
+    const __m256i maxInsert = _mm256_set1_epi32(options.maxInsert);
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= size; i += 8)
     {
-        while (!atEnd(bamFile))
-        {
-            readRecord(record, bamFile);
-            if (checkRecord(record, options))
-                countInsertSize(counts, record, options);
-        }
+        __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tLen + i));
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(ok + i)));
+        __m256i counted = _mm256_and_si256(_mm256_cmpgt_epi32(v, zero), _mm256_cmpgt_epi32(t, minusOne));
+        __m256i longer = _mm256_cmpgt_epi32(t, maxInsert);
+        unsigned denseMask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(longer, counted)));
+        unsigned tailMask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(longer, counted)));
+        for (; denseMask != 0; denseMask &= denseMask - 1)
+            ++counts[tLen[i + __builtin_ctz(denseMask)]];
+        for (; tailMask != 0; tailMask &= tailMask - 1)
+            countTailInsert(tail, tLen[i + __builtin_ctz(tailMask)]);
     }
-    catch (Exception const & e)
+#elif defined(__SSE2__)
+    const __m128i maxInsert = _mm_set1_epi32(options.maxInsert);
+    const __m128i minusOne = _mm_set1_epi32(-1);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= size; i += 4)
     {
-        std::cerr << "Error: "  << e.what() << std::endl;
-        return false;
+        int32_t okBytes;
+        std::memcpy(&okBytes, ok + i, sizeof(okBytes));
+        __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tLen + i));
+        __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(okBytes), zero), zero);
+        __m128i counted = _mm_and_si128(_mm_cmpgt_epi32(v, zero), _mm_cmpgt_epi32(t, minusOne));
+        __m128i longer = _mm_cmpgt_epi32(t, maxInsert);
+        unsigned denseMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(longer, counted)));
+        unsigned tailMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(longer, counted)));
+        for (; denseMask != 0; denseMask &= denseMask - 1)
+            ++counts[tLen[i + __builtin_ctz(denseMask)]];
+        for (; tailMask != 0; tailMask &= tailMask - 1)
+            countTailInsert(tail, tLen[i + __builtin_ctz(tailMask)]);
+    }
+#endif
+    for (; i < size; ++i)                                       //Remaining records
+    {
+        if (!ok[i] || tLen[i] < 0)
+            continue;
+        if (tLen[i] <= options.maxInsert)
+            ++counts[tLen[i]];
+        else
+            countTailInsert(tail, tLen[i]);
     }
-    return true;
 }
 // ---------------------------------------------------------------------------------------
 // Artifact Conversion Counting Functinogs
 // ---------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------
-// Function findTriplet()
+// Function appendTripletHits()
 // ---------------------------------------------------------------------------------------
-//Scans a String for occurences of "needle" using shift-or algorithm, saves occurences in occ return true if found
-inline bool findTriplet(String<unsigned> & occ, Dna5String haystack, Dna5String & needle)
+//Append the positions of all bits set in the masks of one block of the scan, starting at position pos.
+inline void appendTripletHits(String<unsigned> & cagOcc,
+                              String<unsigned> & ctgOcc,
+                              unsigned cagMask,
+                              unsigned ctgMask,
+                              unsigned pos)
 {
-    Finder<Dna5String> finder(haystack);
-    Pattern<Dna5String, ShiftOr> pattern(needle);
-    while (find(finder, pattern))
-        appendValue(occ, beginPosition(finder));
-    return (length(occ) > 0);
+    for (; cagMask != 0; cagMask &= cagMask - 1)
+        appendValue(cagOcc, pos + __builtin_ctz(cagMask));
+    for (; ctgMask != 0; ctgMask &= ctgMask - 1)
+        appendValue(ctgOcc, pos + __builtin_ctz(ctgMask));
 }
 // ---------------------------------------------------------------------------------------
-// Function getNeedles()
+// Function scanTriplets()
 // ---------------------------------------------------------------------------------------
-//Get forward and reverse needle.
-//return 1 if everything is ok, and 0 if the flags are not properly set
-inline int getNeedles(Dna5String & needle, Dna5String & revNeedle, BamAlignmentRecord & record)
+//Scans the 4-bit base codes of a read (as used in BAM-files and by Iupac: A=1, C=2, G=4, T=8) for CAG and CTG in one
+//pass and appends the positions of the occurences to cagOcc and ctgOcc in ascending order.
+//Compares 32 (AVX2) or 16 (SSE2) positions at once, the remaining positions are compared one by one.
+inline void scanTriplets(String<unsigned> & cagOcc,
+                         String<unsigned> & ctgOcc,
+                         const unsigned char * codes,
+                         unsigned len)
 {
-    if (hasFlagFirst(record))                               //Select proper pattern for first/last mate of read pair
+    unsigned i = 0;
+#if defined(__AVX2__)
+    const __m256i c = _mm256_set1_epi8(2);
+    const __m256i a = _mm256_set1_epi8(1);
+    const __m256i t = _mm256_set1_epi8(8);
+    const __m256i g = _mm256_set1_epi8(4);
+    for (; i + 34 <= len; i += 32)
     {
-        if (!hasFlagRC(record))                             //Also consider if read is reverse complement
-        {
-            needle = (Dna5String)"CTG";
-            revNeedle = (Dna5String)"CAG";
-        }
-        else
-        {
-            needle = (Dna5String)"CAG";
-            revNeedle = (Dna5String)"CTG";
-        }
-        return 1;
+        __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + i));
+        __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + i + 1));
+        __m256i third = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + i + 2));
+        __m256i frame = _mm256_and_si256(_mm256_cmpeq_epi8(first, c), _mm256_cmpeq_epi8(third, g));
+        unsigned cagMask = _mm256_movemask_epi8(_mm256_and_si256(frame, _mm256_cmpeq_epi8(second, a)));
+        unsigned ctgMask = _mm256_movemask_epi8(_mm256_and_si256(frame, _mm256_cmpeq_epi8(second, t)));
+        if (cagMask | ctgMask)
+            appendTripletHits(cagOcc, ctgOcc, cagMask, ctgMask, i);
     }
-    else if (hasFlagLast(record))
+#elif defined(__SSE2__)
+    const __m128i c = _mm_set1_epi8(2);
+    const __m128i a = _mm_set1_epi8(1);
+    const __m128i t = _mm_set1_epi8(8);
+    const __m128i g = _mm_set1_epi8(4);
+    for (; i + 18 <= len; i += 16)
     {
-        if (!hasFlagRC(record))
-        {
-            needle = (Dna5String)"CAG";
-            revNeedle = (Dna5String)"CTG";
-        }
-        else
+        __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i));
+        __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i + 1));
+        __m128i third = _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i + 2));
+        __m128i frame = _mm_and_si128(_mm_cmpeq_epi8(first, c), _mm_cmpeq_epi8(third, g));
+        unsigned cagMask = _mm_movemask_epi8(_mm_and_si128(frame, _mm_cmpeq_epi8(second, a)));
+        unsigned ctgMask = _mm_movemask_epi8(_mm_and_si128(frame, _mm_cmpeq_epi8(second, t)));
+        if (cagMask | ctgMask)
+            appendTripletHits(cagOcc, ctgOcc, cagMask, ctgMask, i);
+    }
+#endif
+    for (; i + 3 <= len; ++i)
+    {
+        if (codes[i] != 2 || codes[i + 2] != 4)
+            continue;
+        if (codes[i + 1] == 1)
+            appendValue(cagOcc, i);
+        else if (codes[i + 1] == 8)
+            appendValue(ctgOcc, i);
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function projectToReference()
+// ---------------------------------------------------------------------------------------
+//Translate the ascending positions of triplets in the read to positions on the reference by walking the CIGAR once.
+//Triplets are only kept if all three bases are aligned (M, = or X) without an insertion, deletion or clipping in
+//between. Records without CIGAR are assumed to be aligned without gaps.
+inline void projectToReference(String<unsigned> & occ, const BamAlignmentRecord & record)
+{
+    if (empty(record.cigar))
+    {
+        for (unsigned i = 0; i < length(occ); ++i)
+            occ[i] += record.beginPos;
+        return;
+    }
+    unsigned kept = 0;                                      //Number of projected triplets
+    unsigned i = 0;                                         //Next triplet to project
+    unsigned readPos = 0;
+    unsigned refPos = record.beginPos;
+    unsigned runReadPos = 0;                                //Begin of current run of aligned bases in read...
+    unsigned runRefPos = 0;                                 //...and reference
+    bool inRun = false;
+    for (unsigned c = 0; c < length(record.cigar) && i < length(occ); ++c)
+    {
+        const CigarElement<> & element = record.cigar[c];
+        switch (element.operation)
         {
-            needle = (Dna5String)"CTG";
-            revNeedle = (Dna5String)"CAG";
+            case 'M':
+            case '=':
+            case 'X':
+                if (!inRun)
+                {
+                    runReadPos = readPos;
+                    runRefPos = refPos;
+                    inRun = true;
+                }
+                readPos += element.count;
+                refPos += element.count;
+                for (; i < length(occ) && occ[i] + 3 <= readPos; ++i)
+                    if (occ[i] >= runReadPos)               //Skip triplets beginning before the run
+                        occ[kept++] = runRefPos + occ[i] - runReadPos;
+                break;
+            case 'I':
+            case 'S':
+                inRun = false;
+                readPos += element.count;
+                break;
+            case 'D':
+            case 'N':
+                inRun = false;
+                refPos += element.count;
+                break;
+            default:                                        //H and P consume neither read nor reference
+                break;
         }
-        return 1;
     }
-    else
-        return 0;
+    resize(occ, kept);
 }
 // ---------------------------------------------------------------------------------------
 // Function findNextTriplet()
 // ---------------------------------------------------------------------------------------
 //Return true, if the record contains a relevant triplet, false otherwise
+//occ receives the positions of the artifact-pattern (CTG on forward first and reverse last mates, CAG on the others),
+//nocc the ones of the reverse pattern.
 inline bool findNextTriplet(String<unsigned> & occ,
                            String<unsigned> & nocc,
                            BamAlignmentRecord & record)
 {
-    unsigned c = 0;
-    unsigned nc = 0;
-    Dna5String needle;
-    Dna5String revNeedle;
-    if (!getNeedles(needle, revNeedle, record))             //Select proper pattern for first/last mate of read pair
-        return false;                                       //Skip record without proper first/second mate flag.
+    if (!hasFlagFirst(record) && !hasFlagLast(record))     //Skip record without proper first/second mate flag.
+        return false;
     clear(occ);
     clear(nocc);
-    c = findTriplet(occ, (Dna5String)record.seq, needle);
-    for (unsigned i = 0; i < length(occ); ++i)              //Correct pos in occ for starting position of alignment
-        occ[i] += record.beginPos;
-    nc = findTriplet(nocc, (Dna5String)record.seq, revNeedle);
-    for (unsigned i = 0; i < length(nocc); ++i)             //Correct pos in nocc for starting position of alignment
-        nocc[i] += record.beginPos;
-    return (c || nc);                                       //If there were occurences of the pattern...
+    const unsigned char * codes = reinterpret_cast<const unsigned char *>(begin(record.seq, Standard()));
+    if (hasFlagFirst(record) != hasFlagRC(record))          //Select proper pattern for first/last mate of read pair
+        scanTriplets(nocc, occ, codes, length(record.seq));
+    else
+        scanTriplets(occ, nocc, codes, length(record.seq));
+    projectToReference(occ, record);                        //Get positions of triplets on the reference
+    projectToReference(nocc, record);
+    return (length(occ) > 0 || length(nocc) > 0);           //If there were occurences of the pattern...
 }
 // ---------------------------------------------------------------------------------------
-// Function findNextTripletAndCountInsert()
+// Struct ReferenceCache
 // ---------------------------------------------------------------------------------------
-//Check each sequence using findTriplet() with the repective pattern until the pattern occurs.
-//Additionally performs insert-size counting
-//Return true if the current record has a relevant triplet, false otherwise
-inline bool findNextTripletAndCountInsert(String<unsigned> & occ,
-                           String<unsigned> & nocc,
-                           TInsertDistr & InsertCounts,
-                           BamAlignmentRecord & record,
-                           const ProgramOptions & options)
+//Holds a window of one contig of the reference genome in memory. As the BAM-file is sorted by coordinate, the window
+//only has to be reloaded when the contig changes or a position behind the current window is requested.
+struct ReferenceCache
 {
-    Dna5String needle;
-    Dna5String revNeedle;
-    if (!getNeedles(needle, revNeedle, record))             //Select proper pattern for first/last mate of read pair
-        return false;                                       //Skip record without proper first/second mate flag.
-    unsigned c = 0;
-    unsigned nc = 0;
-    clear(occ);
-    clear(nocc);
-    c = findTriplet(occ, (Dna5String)record.seq, needle);
-    for (unsigned i = 0; i < length(occ); ++i)              //Correct pos in occ for starting position of alignment
-        occ[i] += record.beginPos;
-    nc = findTriplet(nocc, (Dna5String)record.seq, revNeedle);
-    for (unsigned i = 0; i < length(nocc); ++i)             //Correct pos in occ for starting position of alignment
-        nocc[i] += record.beginPos;
-    countInsertSize(InsertCounts, record, options);
-    return (c || nc);                                       //If there were occurences of the pattern...
+    int faiId = -1;                             //FAI-id of the contig held in the cache, -1 if none is loaded
+    uint64_t contigLength = 0;
+    uint64_t windowBegin = 0;                   //Position of the first base of window on the contig
+    uint64_t windowSize = 4194304;              //Number of bases loaded at once
+    uint64_t windowMargin = 65536;              //Number of bases kept in front of the requested position
+    Dna5String window;
+    const ContextIndex * ctxIndex = NULL;       //Context-index of the reference, NULL if the window is used instead
+    const PackedReference * packedRef = NULL;   //Packed reference, NULL if the window is read from the FASTA-file
+};
+// ---------------------------------------------------------------------------------------
+// Function loadWindow()
+// ---------------------------------------------------------------------------------------
+//Load the part of the cached contig starting shortly in front of pos into the window, from the packed reference if
+//available.
+inline void loadWindow(ReferenceCache & cache, FaiIndex & faiIndex, uint64_t pos)
+{
+    cache.windowBegin = (pos > cache.windowMargin) ? pos - cache.windowMargin : 0;
+    uint64_t windowEnd = std::min(cache.windowBegin + cache.windowSize, cache.contigLength);
+    if (cache.packedRef != NULL)
+        readPackedRegion(cache.window, *cache.packedRef, cache.faiId, cache.windowBegin, windowEnd);
+    else
+        readRegion(cache.window, faiIndex, cache.faiId, cache.windowBegin, windowEnd);
+}
+// ---------------------------------------------------------------------------------------
+// Function selectContig()
+// ---------------------------------------------------------------------------------------
+//Make the contig with the FAI-id faiId the current contig of the cache.
+inline void selectContig(ReferenceCache & cache, FaiIndex & faiIndex, unsigned faiId)
+{
+    if (cache.faiId == (int)faiId)
+        return;
+    cache.faiId = faiId;
+    cache.contigLength = sequenceLength(faiIndex, cache.faiId);
+    cache.windowBegin = 0;
+    clear(cache.window);
 }
 // ---------------------------------------------------------------------------------------
 // Function getRefAt()
 // ---------------------------------------------------------------------------------------
-//Takes a sequence id (chr) and a position and returns the triplet of the reference genome at that position +- 1
-inline int getRefAt (Dna5String & ref, FaiIndex & faiIndex, CharString id, unsigned pos)
+//Takes the FAI-id of a contig (see mapContigs()) and a position and returns the triplet of the reference genome at that
+//position +- 1. The triplet is copied from the cache.
+inline int getRefAt (Dna5String & ref,
+                     ReferenceCache & cache,
+                     FaiIndex & faiIndex,
+                     unsigned faiId,
+                     unsigned pos)
 {
-    unsigned idx = 0;                                       //Holder for position of id in index
-    ref = "";
-    getIdByName(idx, faiIndex, id);                         //Get position of sequence by its ID and save it in idx
-    if (pos + 1 > sequenceLength(faiIndex, idx))            //Make sure the pos lies within the boundaries of the index
-        pos = sequenceLength(faiIndex, idx) - 2;
-    readRegion(ref, faiIndex, idx, pos, pos + 3);           //Get infix
+    selectContig(cache, faiIndex, faiId);
+    if (pos + 1 > cache.contigLength)                       //Make sure the pos lies within the boundaries of the index
+        pos = cache.contigLength - 2;
+    uint64_t end = std::min((uint64_t)pos + 3, cache.contigLength);
+    if (pos < cache.windowBegin || end > cache.windowBegin + length(cache.window))
+        loadWindow(cache, faiIndex, pos);
+    ref = infix(cache.window, pos - cache.windowBegin, end - cache.windowBegin);    //Get infix
     return 0;
 }
 // ---------------------------------------------------------------------------------------
+// Function getContextAt()
+// ---------------------------------------------------------------------------------------
+//Same as getRefAt(), but only returns whether the triplet is CCG, CGG or anything else. Uses the context-index if
+//available, then the packed reference and the window of the reference otherwise.
+inline ContextType getContextAt(Dna5String & ref,
+                                ReferenceCache & cache,
+                                FaiIndex & faiIndex,
+                                unsigned faiId,
+                                unsigned pos)
+{
+    if (cache.ctxIndex == NULL && cache.packedRef == NULL)
+    {
+        getRefAt(ref, cache, faiIndex, faiId, pos);
+        if (ref == "CCG")
+            return CONTEXT_CCG;
+        if (ref == "CGG")
+            return CONTEXT_CGG;
+        return CONTEXT_OTHER;
+    }
+    selectContig(cache, faiIndex, faiId);
+    if (pos + 1 > cache.contigLength)                       //Same clipping as in getRefAt()
+        pos = cache.contigLength - 2;
+    if ((uint64_t)pos + 3 > cache.contigLength)
+        return CONTEXT_OTHER;
+    if (cache.ctxIndex == NULL)
+        return getPackedContext(*cache.packedRef, cache.faiId, pos);
+    if (getContextBit(*cache.ctxIndex, cache.ctxIndex->ccgBegin[cache.faiId], pos))
+        return CONTEXT_CCG;
+    if (getContextBit(*cache.ctxIndex, cache.ctxIndex->cggBegin[cache.faiId], pos))
+        return CONTEXT_CGG;
+    return CONTEXT_OTHER;
+}
+// ---------------------------------------------------------------------------------------
+// Struct MDReference
+// ---------------------------------------------------------------------------------------
+//Reference under the alignment of one record, reconstructed from the read and its MD-tag.
+struct MDReference
+{
+    bool enabled = false;                       //Use the MD-tag if present (-md)
+    bool warned = false;                        //Warning about records without MD-tag and reference already given
+    int32_t beginPos = 0;                       //Position of the first base of seq on the contig
+    CharString md;
+    Dna5String seq;                             //Reference from beginPos to the end of the alignment
+};
+// ---------------------------------------------------------------------------------------
+// Function nextMDBase()
+// ---------------------------------------------------------------------------------------
+//Move to the next CIGAR-operation described by the MD-tag (M, =, X or D) if the current one is used up. Skipped
+//regions (N) are not part of the MD-tag and only advance refPos. Return false if the CIGAR is used up.
+inline bool nextMDBase(unsigned & refPos, unsigned & left, unsigned & c, const String<CigarElement<> > & cigar)
+{
+    while (left == 0)
+    {
+        if (c >= length(cigar))
+            return false;
+        char op = cigar[c].operation;
+        if (op == 'M' || op == '=' || op == 'X' || op == 'D')
+            left = cigar[c].count;
+        else if (op == 'N')
+            refPos += cigar[c].count;
+        ++c;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function skipMDBases()
+// ---------------------------------------------------------------------------------------
+//Skip n reference bases described by the MD-tag. Return false if the CIGAR is used up before.
+inline bool skipMDBases(unsigned & refPos,
+                        unsigned & left,
+                        unsigned & c,
+                        const String<CigarElement<> > & cigar,
+                        unsigned n)
+{
+    while (n > 0)
+    {
+        if (!nextMDBase(refPos, left, c, cigar))
+            return false;
+        unsigned step = std::min(left, n);
+        refPos += step;
+        left -= step;
+        n -= step;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function extractMDTag()
+// ---------------------------------------------------------------------------------------
+//Copy the value of the MD-tag from the tags of a BAM-record to md. Walks the tags directly instead of building a
+//BamTagsDict, which would copy the tags of every record. Return false if there is no MD-tag or the tags are damaged.
+inline bool extractMDTag(CharString & md, const CharString & tags)
+{
+    const char * it = begin(tags, Standard());
+    const char * tagsEnd = end(tags, Standard());
+    while (tagsEnd - it >= 3)
+    {
+        bool isMD = it[0] == 'M' && it[1] == 'D';
+        char type = it[2];
+        it += 3;
+        if (type == 'Z' || type == 'H')                         //Null-terminated string
+        {
+            const char * valueEnd = std::find(it, tagsEnd, '\0');
+            if (valueEnd == tagsEnd)
+                return false;
+            if (isMD)
+            {
+                if (type != 'Z')
+                    return false;
+                clear(md);
+                append(md, infix(tags, it - begin(tags, Standard()), valueEnd - begin(tags, Standard())));
+                return true;
+            }
+            it = valueEnd + 1;
+        }
+        else if (type == 'B')                                   //Array: element type, number of elements, elements
+        {
+            if (tagsEnd - it < 5)
+                return false;
+            int elementSize = getBamTypeSize(it[0]);
+            uint32_t count = 0;
+            std::memcpy(&count, it + 1, sizeof(count));
+            if (elementSize <= 0)
+                return false;
+            it += 5 + (uint64_t)count * elementSize;
+        }
+        else
+        {
+            int size = getBamTypeSize(type);
+            if (size <= 0 || isMD)
+                return false;
+            it += size;
+        }
+    }
+    return false;
+}
+// ---------------------------------------------------------------------------------------
+// Function getMDReference()
+// ---------------------------------------------------------------------------------------
+//Reconstruct the reference under the alignment of record: Aligned bases are copied from the read, mismatches and
+//deleted bases are taken from the MD-tag and skipped regions (N) are filled with N.
+//Return false if the record has no MD-tag or the MD-tag does not fit the CIGAR, true otherwise.
+inline bool getMDReference(MDReference & mdRef, const BamAlignmentRecord & record)
+{
+    if (!extractMDTag(mdRef.md, record.tags))
+        return false;
+    mdRef.beginPos = record.beginPos;
+    unsigned left = 0;                                      //Bases left in the current CIGAR-operation
+    if (empty(record.cigar))                                //Aligned without gaps
+    {
+        mdRef.seq = record.seq;
+        left = length(record.seq);
+    }
+    else
+    {
+        clear(mdRef.seq);
+        unsigned readPos = 0;
+        for (unsigned c = 0; c < length(record.cigar); ++c)
+        {
+            const CigarElement<> & element = record.cigar[c];
+            switch (element.operation)
+            {
+                case 'M':
+                case '=':
+                case 'X':
+                    if (readPos + element.count > length(record.seq))
+                        return false;
+                    append(mdRef.seq, infix(record.seq, readPos, readPos + element.count));
+                    readPos += element.count;
+                    break;
+                case 'I':
+                case 'S':
+                    readPos += element.count;
+                    break;
+                case 'D':
+                case 'N':
+                    resize(mdRef.seq, length(mdRef.seq) + element.count, 'N');
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    unsigned refPos = 0;                                    //Position in mdRef.seq
+    unsigned c = 0;                                         //Next CIGAR-operation
+    unsigned matches = 0;
+    for (unsigned k = 0; k < length(mdRef.md); ++k)
+    {
+        char mdChar = mdRef.md[k];
+        if (mdChar >= '0' && mdChar <= '9')
+        {
+            matches = matches * 10 + (mdChar - '0');
+            continue;
+        }
+        if (!skipMDBases(refPos, left, c, record.cigar, matches))
+            return false;
+        matches = 0;
+        if (mdChar == '^')                                  //Deleted bases follow, handled like mismatches
+            continue;
+        if (!nextMDBase(refPos, left, c, record.cigar) || refPos >= length(mdRef.seq))
+            return false;
+        mdRef.seq[refPos] = mdChar;
+        ++refPos;
+        --left;
+    }
+    return skipMDBases(refPos, left, c, record.cigar, matches);
+}
+// ---------------------------------------------------------------------------------------
+// Function getMDContextAt()
+// ---------------------------------------------------------------------------------------
+//Same as getContextAt(), but takes the triplet from the reference reconstructed by getMDReference().
+inline ContextType getMDContextAt(const MDReference & mdRef, unsigned pos)
+{
+    if (pos < (unsigned)mdRef.beginPos || pos - mdRef.beginPos + 3 > length(mdRef.seq))
+        return CONTEXT_OTHER;
+    unsigned i = pos - mdRef.beginPos;
+    if (mdRef.seq[i] != 'C' || mdRef.seq[i + 2] != 'G')
+        return CONTEXT_OTHER;
+    if (mdRef.seq[i + 1] == 'C')
+        return CONTEXT_CCG;
+    if (mdRef.seq[i + 1] == 'G')
+        return CONTEXT_CGG;
+    return CONTEXT_OTHER;
+}
+// ---------------------------------------------------------------------------------------
 // Function checkContext()
 // ---------------------------------------------------------------------------------------
 //Takes the infix from the reference and and compares it to the artifact context.
@@ -230,151 +699,118 @@ inline bool checkNAContext(const Dna5String & ref, bool firstMate, bool rc)
     }
 }
 // ---------------------------------------------------------------------------------------
-// Function checkAndSkip()
+// Function checkContext()
 // ---------------------------------------------------------------------------------------
-//Check the record and return false if it should be skippe, true otherwise.
-inline bool checkAndSkip(CharString & contig,
-                        CharString & previousContig,
-                        BamAlignmentRecord & record,
-                        BamFileIn & bamFile,
-                        FaiIndex & faiIndex,
-                        const ProgramOptions & options)
+//Same as above for a context returned by getContextAt().
+inline bool checkContext(ContextType context, bool firstMate, bool rc)
 {
-    if (!checkRecord(record, options))
-        return false;
-    unsigned idx = 0;
-    contig = getContigName(record, bamFile);
-    if (!getIdByName(idx, faiIndex, contig))
+    return context == ((firstMate != rc) ? CONTEXT_CGG : CONTEXT_CCG);
+}
+// ---------------------------------------------------------------------------------------
+// Function checkNAContext()
+// ---------------------------------------------------------------------------------------
+//Same as above for a context returned by getContextAt().
+inline bool checkNAContext(ContextType context, bool firstMate, bool rc)
+{
+    return context == ((firstMate != rc) ? CONTEXT_CCG : CONTEXT_CGG);
+}
+// ---------------------------------------------------------------------------------------
+// Struct ContigMap
+// ---------------------------------------------------------------------------------------
+//FAI-id of each contig of the BAM-header, looked up once after reading the header.
+struct ContigMap
+{
+    String<int32_t> faiIds;                     //-1 if the contig is missing in the reference
+    String<bool> warned;                        //Missing contig has already been reported
+};
+// ---------------------------------------------------------------------------------------
+// Function mapContigs()
+// ---------------------------------------------------------------------------------------
+//Look up all contigs of the BAM-header in the FAI-index.
+inline void mapContigs(ContigMap & contigMap, const StringSet<CharString> & contigNameStore, const FaiIndex & faiIndex)
+{
+    clear(contigMap.faiIds);
+    resize(contigMap.faiIds, length(contigNameStore), -1);
+    clear(contigMap.warned);
+    resize(contigMap.warned, length(contigNameStore), false);
+    for (unsigned rID = 0; rID < length(contigNameStore); ++rID)
     {
-        if (contig != previousContig)
-        {
-            std::cout << "WARNING: Cannot find contig " << contig << " in index. Skipping..." << std::endl;
-            previousContig = contig;
-        }
-        return false;
+        unsigned faiId = 0;
+        if (getIdByName(faiId, faiIndex, contigNameStore[rID]))
+            contigMap.faiIds[rID] = faiId;
     }
-    return true;
 }
 // ---------------------------------------------------------------------------------------
-// Function getArtifactCount()
+// Function checkAndSkip()
 // ---------------------------------------------------------------------------------------
-//Wrapper for calling all functions necessary for finding all CCG > CAG or CGG > CTG occurences and non-artifacts.
-//Returns the number of occurences as i1 and number of non-artifactual conversions as i2
-inline bool getArtifactCount(unsigned (& artifactConv) [2][2],
-                                                 unsigned (& normalConv) [2][2], 
-                                                 BamFileIn & bamFile,
-                                                 FaiIndex & faiIndex,
-                                                 const ProgramOptions & options)
+//Check if the contig of the record is part of the reference and return false if it should be skipped, true otherwise.
+//Sets faiId to the FAI-id of the contig. Each missing contig is only reported once.
+inline bool checkAndSkip(unsigned & faiId,
+                         ContigMap & contigMap,
+                         const BamAlignmentRecord & record,
+                         const StringSet<CharString> & contigNameStore,
+                         const ProgramOptions & options)
 {
-    unsigned hits = 0;                  //counter for verified hits.
-    unsigned nonHits = 0;               //counter for non artifactual conversions
-    BamAlignmentRecord record;
-    String<unsigned> occ = "";
-    reserve(occ, 5);
-    String<unsigned> nocc = "";
-    reserve(occ, 5);
-    Dna5String ref = "";                //Will hold triplet of reference after call of getRefAt
-    CharString previousContig = "";
-    CharString contig = "";
-    try
+    if (empty(options.refPath))                             //Only the MD-tag is used
+        return true;
+    if (record.rID < 0 || (unsigned)record.rID >= length(contigMap.faiIds))
+        return false;
+    if (contigMap.faiIds[record.rID] < 0)
     {
-        while (!atEnd(bamFile))
+        if (!contigMap.warned[record.rID])
         {
-            readRecord(record, bamFile);
-            if (!checkAndSkip(contig, previousContig, record, bamFile, faiIndex, options))
-                continue;
-            if (!findNextTriplet(occ, nocc, record))
-                continue;
-            CharString id = getContigName(record, bamFile);
-            bool isFirst = hasFlagFirst(record);
-            bool isRC = hasFlagRC(record);
-            for (unsigned i = 0; i < length(occ); ++i)
-            {
-                getRefAt(ref, faiIndex,  id, occ[i]);
-                if (checkContext(ref, isFirst, isRC))
-                {
-                    ++hits;
-                    ++artifactConv[isFirst][isRC];
-                }
-            }
-            for (unsigned j = 0; j < length(nocc); ++j)
-            {
-                getRefAt(ref, faiIndex,  id, nocc[j]);
-                if (checkNAContext(ref, isFirst, isRC))
-                {
-                    ++nonHits;
-                    ++normalConv[isFirst][isRC];
-                }
-            }
+            std::cout << "WARNING: Cannot find contig " << contigNameStore[record.rID] << " in index. Skipping..."
+                      << std::endl;
+            contigMap.warned[record.rID] = true;
         }
-        return true;
-    }
-    catch (Exception const & e)
-    {
-        std::cerr << "Error: "  << e.what() << std::endl;
         return false;
     }
+    faiId = contigMap.faiIds[record.rID];
+    return true;
 }
 // ---------------------------------------------------------------------------------------
-// Function wrapDoAll()
+// Function countConversions()
 // ---------------------------------------------------------------------------------------
-//Wrapper for calling both checks in one run. Return 1 on error, 0 otherwise
-inline bool wrapDoAll(unsigned (& artifactConv) [2][2],
-                     unsigned (& normalConv) [2][2],
-                     TInsertDistr & InsertCounts, 
-                     BamFileIn & bamFile,
-                     ProgramOptions & options)
+//Compare the reference context of all triplets found by findNextTriplet() and count artifacts and non-artifacts.
+//The context is taken from the MD-tag if enabled and present, from the reference otherwise. Records without MD-tag are
+//skipped if no reference genome is given.
+inline void countConversions(TConvTable & artifactConv,
+                             TConvTable & normalConv,
+                             Dna5String & ref,
+                             ReferenceCache & refCache,
+                             MDReference & mdRef,
+                             FaiIndex & faiIndex,
+                             const String<unsigned> & occ,
+                             const String<unsigned> & nocc,
+                             const BamAlignmentRecord & record,
+                             unsigned faiId)
 {
-    FaiIndex faiIndex;
-    if (!loadRefIdx(faiIndex, toCString(options.refPath)))
-        return 0;
-    BamAlignmentRecord record;
-    unsigned hits = 0;                  //counter for verified hits.
-    unsigned nonHits = 0;               //counter for non artifactual conversions
-    String<unsigned> occ = "";          //positions of artifacual triplets
-    reserve(occ, 5);
-    String<unsigned> nocc = "";         //positions of non-artifactual triplets
-    reserve(occ, 5);
-    Dna5String ref = "";                //Will hold triplet of reference after call of getRefAt
-    CharString previousContig = "";
-    CharString contig = "";
-    try
+    bool isFirst = hasFlagFirst(record);
+    bool isRC = hasFlagRC(record);
+    bool useMD = mdRef.enabled && getMDReference(mdRef, record);
+    if (!useMD && numSeqs(faiIndex) == 0)
     {
-        while (!atEnd(bamFile))
+        if (!mdRef.warned)
         {
-            readRecord(record, bamFile);
-            if (!checkAndSkip(contig, previousContig, record, bamFile, faiIndex, options))
-                continue;
-            if (!findNextTripletAndCountInsert(occ, nocc, InsertCounts, record, options))
-                continue;
-            contig = getContigName(record, bamFile);
-            bool isFirst = hasFlagFirst(record);
-            bool isRC = hasFlagRC(record);
-            for (unsigned i = 0; i < length(occ); ++i)
-            {
-                getRefAt(ref, faiIndex, contig, occ[i]);
-                if (checkContext(ref, isFirst, isRC))
-                {
-                    ++hits;
-                    ++artifactConv[isFirst][isRC];
-                }
-            }
-            for (unsigned j = 0; j < length(nocc); ++j)
-            {
-                getRefAt(ref, faiIndex, contig, nocc[j]);
-                if (checkNAContext(ref, isFirst, isRC))
-                {
-                    ++nonHits;
-                    ++normalConv[isFirst][isRC];
-                }
-            }
+            std::cerr << "WARNING: Found alignments without MD-tag, but no reference genome is given. Skipping..."
+                      << std::endl;
+            mdRef.warned = true;
         }
-        return true;
+        return;
     }
-    catch (Exception const & e)
+    for (unsigned i = 0; i < length(occ); ++i)
     {
-        std::cerr << "Error: "  << e.what() << std::endl;
-        return false;
+        ContextType context = useMD ? getMDContextAt(mdRef, occ[i]) :
+                                      getContextAt(ref, refCache, faiIndex, faiId, occ[i]);
+        if (checkContext(context, isFirst, isRC))
+            ++artifactConv[isFirst][isRC];
+    }
+    for (unsigned j = 0; j < length(nocc); ++j)
+    {
+        ContextType context = useMD ? getMDContextAt(mdRef, nocc[j]) :
+                                      getContextAt(ref, refCache, faiIndex, faiId, nocc[j]);
+        if (checkNAContext(context, isFirst, isRC))
+            ++normalConv[isFirst][isRC];
     }
 }
-#endif /* BAMQC_H_ */
\ No newline at end of file
+#endif /* BAMQC_H_ */
@@ -0,0 +1,343 @@
+#ifndef BGZF_REFERENCE_H_
+#define BGZF_REFERENCE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <seqan/seq_io.h>
+#include <seqan/stream.h>
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// BGZF-compressed reference genome
+// ---------------------------------------------------------------------------------------
+//A reference genome compressed with bgzip consists of independently compressed blocks of at most 64 KiB. Its
+//GZI-index (REFERENCE.gzi, as written by bgzip -i or samtools faidx) lists the start of each block after the first in
+//the compressed and the decompressed file as pairs of little-endian 64-bit integers, preceded by their number. The
+//FAI-index refers to positions in the decompressed file.
+// ---------------------------------------------------------------------------------------
+// Struct BgzfBlockIndex
+// ---------------------------------------------------------------------------------------
+//Start of each block in the compressed and the decompressed file, followed by the end of the last block.
+struct BgzfBlockIndex
+{
+    CharString fileName;                        //BGZF-file the blocks belong to
+    String<uint64_t> compressed;
+    String<uint64_t> uncompressed;
+};
+// ---------------------------------------------------------------------------------------
+// Function isBgzfFile()
+// ---------------------------------------------------------------------------------------
+//Return true if the file begins with a BGZF-block, false otherwise.
+inline bool isBgzfFile(const CharString & fileName)
+{
+    char header[BGZF_BLOCK_HEADER_LENGTH];
+    std::ifstream file(toCString(fileName), std::ios_base::in | std::ios_base::binary);
+    return file.read(header, sizeof(header)) && _bgzfCheckHeader(header);
+}
+// ---------------------------------------------------------------------------------------
+// Function preadBytes()
+// ---------------------------------------------------------------------------------------
+//Read exactly length bytes at offset of the file descriptor fd into data. Return false on errors or at the end of
+//the file, true otherwise.
+inline bool preadBytes(int fd, char * data, uint64_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = ::pread(fd, data, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function scanBgzfBlocks()
+// ---------------------------------------------------------------------------------------
+//Complete blocks, whose last entry is the start of a block, with the following blocks of the file fd of fileSize
+//bytes and the end of the last block. Only the header and the footer of each block are read. Return false if the
+//file does not continue with complete BGZF-blocks, true otherwise.
+inline bool scanBgzfBlocks(BgzfBlockIndex & blocks, int fd, uint64_t fileSize)
+{
+    uint64_t compressedPos = back(blocks.compressed);
+    uint64_t uncompressedPos = back(blocks.uncompressed);
+    eraseBack(blocks.compressed);
+    eraseBack(blocks.uncompressed);
+    char header[BGZF_BLOCK_HEADER_LENGTH];
+    char footer[BGZF_BLOCK_FOOTER_LENGTH];
+    while (compressedPos < fileSize)
+    {
+        if (!preadBytes(fd, header, sizeof(header), compressedPos) || !_bgzfCheckHeader(header))
+            return false;
+        uint64_t blockLength = _bgzfUnpack16(header + 16) + 1u;
+        if (blockLength < sizeof(header) + sizeof(footer) ||
+            !preadBytes(fd, footer, sizeof(footer), compressedPos + blockLength - sizeof(footer)))
+            return false;
+        appendValue(blocks.compressed, compressedPos);
+        appendValue(blocks.uncompressed, uncompressedPos);
+        compressedPos += blockLength;
+        uncompressedPos += _bgzfUnpack32(footer + 4);
+    }
+    appendValue(blocks.compressed, compressedPos);
+    appendValue(blocks.uncompressed, uncompressedPos);
+    return compressedPos == fileSize;
+}
+// ---------------------------------------------------------------------------------------
+// Function buildGzi()
+// ---------------------------------------------------------------------------------------
+//Fill blocks from the headers of all blocks of the BGZF-file fileName. Return false on errors, true otherwise.
+inline bool buildGzi(BgzfBlockIndex & blocks, const CharString & fileName)
+{
+    struct stat fileStat;
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd < 0)
+        return false;
+    clear(blocks.compressed);
+    clear(blocks.uncompressed);
+    appendValue(blocks.compressed, 0);
+    appendValue(blocks.uncompressed, 0);
+    bool ok = fstat(fd, &fileStat) == 0 && scanBgzfBlocks(blocks, fd, fileStat.st_size);
+    ::close(fd);
+    blocks.fileName = fileName;
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Function openGzi()
+// ---------------------------------------------------------------------------------------
+//Read the GZI-index gziFileName of the BGZF-file fileName into blocks. The end of the last block is taken from the
+//file, which must continue with complete blocks behind the last indexed one. Return false if the index is missing
+//or does not match the file, true otherwise.
+inline bool openGzi(BgzfBlockIndex & blocks, const CharString & fileName, const CharString & gziFileName)
+{
+    std::ifstream gzi(toCString(gziFileName), std::ios_base::in | std::ios_base::binary);
+    uint64_t numEntries = 0;
+    struct stat fileStat;
+    if (!gzi.read(reinterpret_cast<char *>(&numEntries), sizeof(numEntries)) ||
+        stat(toCString(fileName), &fileStat) != 0 || numEntries > (uint64_t)fileStat.st_size)
+        return false;
+    clear(blocks.compressed);
+    clear(blocks.uncompressed);
+    appendValue(blocks.compressed, 0);
+    appendValue(blocks.uncompressed, 0);
+    uint64_t entry[2];
+    for (uint64_t e = 0; e < numEntries; ++e)
+    {
+        if (!gzi.read(reinterpret_cast<char *>(entry), sizeof(entry)) || entry[0] <= back(blocks.compressed) ||
+            entry[0] >= (uint64_t)fileStat.st_size || entry[1] < back(blocks.uncompressed))
+            return false;
+        appendValue(blocks.compressed, entry[0]);
+        appendValue(blocks.uncompressed, entry[1]);
+    }
+    int fd = ::open(toCString(fileName), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = scanBgzfBlocks(blocks, fd, fileStat.st_size);
+    ::close(fd);
+    blocks.fileName = fileName;
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Function saveGzi()
+// ---------------------------------------------------------------------------------------
+//Write blocks to gziFileName. The index is first written to a temporary file, so that concurrent runs never see an
+//incomplete index. Return false on errors, true otherwise.
+inline bool saveGzi(const BgzfBlockIndex & blocks, const CharString & gziFileName)
+{
+    CharString tmpFileName = gziFileName;                              //Unique per process, runs may build it at once
+    append(tmpFileName, "." + std::to_string(getpid()) + ".tmp");
+    std::ofstream out(toCString(tmpFileName), std::ios_base::out | std::ios_base::binary);
+    if (!out.good())
+        return false;
+    uint64_t numEntries = length(blocks.compressed) - 2;                //Neither the first block nor the end
+    out.write(reinterpret_cast<const char *>(&numEntries), sizeof(numEntries));
+    for (uint64_t b = 1; b <= numEntries; ++b)
+    {
+        uint64_t entry[2] = {blocks.compressed[b], blocks.uncompressed[b]};
+        out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+    }
+    out.close();
+    if (out.fail() || std::rename(toCString(tmpFileName), toCString(gziFileName)) != 0)
+    {
+        std::remove(toCString(tmpFileName));
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function findBgzfBlock()
+// ---------------------------------------------------------------------------------------
+//Return the block holding position pos of the decompressed file, which must be before its end. Empty blocks are
+//skipped.
+inline uint64_t findBgzfBlock(const BgzfBlockIndex & blocks, uint64_t pos)
+{
+    const uint64_t * first = begin(blocks.uncompressed, Standard());
+    const uint64_t * last = end(blocks.uncompressed, Standard()) - 1;  //Without the end of the last block
+    return std::upper_bound(first, last, pos) - first - 1;
+}
+// ---------------------------------------------------------------------------------------
+// Function readBgzfBlock()
+// ---------------------------------------------------------------------------------------
+//Read block of the BGZF-file fd into compressed and decompress it to data, which must hold BGZF_MAX_BLOCK_SIZE bytes.
+//Return the number of decompressed bytes, throw an IOError if the block cannot be read or does not match blocks.
+inline uint64_t readBgzfBlock(char * data,
+                              std::vector<char> & compressed,
+                              int fd,
+                              const BgzfBlockIndex & blocks,
+                              uint64_t block)
+{
+    uint64_t compressedLength = blocks.compressed[block + 1] - blocks.compressed[block];
+    compressed.resize(compressedLength);
+    if (compressedLength > BGZF_MAX_BLOCK_SIZE ||
+        !preadBytes(fd, &compressed[0], compressedLength, blocks.compressed[block]))
+        throw IOError("Could not read BGZF-block of the reference genome.");
+    CompressionContext<BgzfFile> ctx;
+    uint64_t dataLength = _decompressBlock(data, BGZF_MAX_BLOCK_SIZE, &compressed[0], compressedLength, ctx);
+    if (dataLength != blocks.uncompressed[block + 1] - blocks.uncompressed[block])
+        throw IOError("BGZF-block of the reference genome does not match its GZI-index.");
+    return dataLength;
+}
+// ---------------------------------------------------------------------------------------
+// Class BgzfFileBuffer
+// ---------------------------------------------------------------------------------------
+//Read-only stream buffer on the decompressed content of a BGZF-file, seekable to any position via its block index.
+//The get area is the decompressed block holding the current position. The most recently used blocks are kept
+//decompressed, so that the overlapping windows read from the reference do not decompress a block twice.
+class BgzfFileBuffer : public std::streambuf
+{
+public:
+    struct CachedBlock
+    {
+        uint64_t block = (uint64_t)-1;          //Block held, -1 if none
+        uint64_t lastUse = 0;
+        uint64_t length = 0;
+        std::vector<char> data;
+    };
+
+    int fd = -1;
+    BgzfBlockIndex blocks;
+    std::vector<CachedBlock> cache;
+    uint64_t uses = 0;
+    uint64_t getBegin = 0;                      //Position of eback() in the decompressed file
+    std::vector<char> compressed;
+
+    BgzfFileBuffer() {}
+    BgzfFileBuffer(const BgzfFileBuffer &) = delete;
+    BgzfFileBuffer & operator=(const BgzfFileBuffer &) = delete;
+
+    ~BgzfFileBuffer()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    //Make block the get area with the current position pos, decompressing it into the least recently used cache
+    //slot if it is not cached.
+    void loadBlock(uint64_t block, uint64_t pos)
+    {
+        CachedBlock * slot = &cache[0];
+        for (CachedBlock & cached : cache)
+        {
+            if (cached.block == block)
+            {
+                slot = &cached;
+                break;
+            }
+            if (cached.lastUse < slot->lastUse)
+                slot = &cached;
+        }
+        if (slot->block != block)
+        {
+            slot->block = (uint64_t)-1;
+            slot->data.resize(BGZF_MAX_BLOCK_SIZE);
+            slot->length = readBgzfBlock(&slot->data[0], compressed, fd, blocks, block);
+            slot->block = block;
+        }
+        slot->lastUse = ++uses;
+        getBegin = blocks.uncompressed[block];
+        setg(&slot->data[0], &slot->data[0] + (pos - getBegin), &slot->data[0] + slot->length);
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        uint64_t pos = getBegin + (egptr() - eback());
+        if (pos >= back(blocks.uncompressed))
+            return traits_type::eof();
+        loadBlock(findBgzfBlock(blocks, pos), pos);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which & std::ios_base::in) || fd < 0)
+            return pos_type(off_type(-1));
+        off_type pos = off;
+        if (dir == std::ios_base::cur)
+            pos += getBegin + (gptr() - eback());
+        else if (dir == std::ios_base::end)
+            pos += back(blocks.uncompressed);
+        if (pos < 0 || (uint64_t)pos > back(blocks.uncompressed))
+            return pos_type(off_type(-1));
+        if ((uint64_t)pos >= getBegin && (uint64_t)pos < getBegin + (egptr() - eback()))
+        {
+            setg(eback(), eback() + (pos - getBegin), egptr());
+        }
+        else
+        {
+            getBegin = pos;                                             //Decompressed on the next read
+            setg(NULL, NULL, NULL);
+        }
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Struct ReferenceIndex
+// ---------------------------------------------------------------------------------------
+//FAI-index of the reference genome. For a BGZF-compressed reference it owns the buffer readRegion() reads the
+//decompressed FASTA-file through.
+struct ReferenceIndex : FaiIndex
+{
+    std::unique_ptr<BgzfFileBuffer> bgzfBuffer;
+
+    ~ReferenceIndex()
+    {
+        file.std::istream::rdbuf(file.rdbuf());                         //Detach the buffer before it is destroyed
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Function openBgzfReference()
+// ---------------------------------------------------------------------------------------
+//Read the reference genome of refIndex through a BGZF-buffer with the block index blocks, keeping up to cacheBlocks
+//blocks decompressed. Return false if the reference cannot be opened, true otherwise.
+inline bool openBgzfReference(ReferenceIndex & refIndex, const BgzfBlockIndex & blocks, unsigned cacheBlocks = 64)
+{
+    std::unique_ptr<BgzfFileBuffer> buffer(new BgzfFileBuffer);
+    buffer->fd = ::open(toCString(refIndex.fastaFilename), O_RDONLY);
+    if (buffer->fd < 0)
+        return false;
+    buffer->blocks = blocks;
+    buffer->cache.resize(std::max(cacheBlocks, 1u));
+    refIndex.file.std::istream::rdbuf(buffer.get());
+    refIndex.bgzfBuffer = std::move(buffer);
+    return true;
+}
+#endif /* BGZF_REFERENCE_H_ */
@@ -0,0 +1,237 @@
+#ifndef CONTEXT_INDEX_H_
+#define CONTEXT_INDEX_H_
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <seqan/file.h>
+#include "parse.h"
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Context-index of the reference genome
+// ---------------------------------------------------------------------------------------
+//The context-index (REFERENCE.ctx) holds two bitvectors per contig of the reference genome, marking all positions at
+//which a CCG or CGG triplet starts. Layout in 64-bit words:
+//magic, size of FASTA-file, mtime of FASTA-file, number of contigs, length of each contig (in FAI-order), then for each
+//contig ceil(length / 64) words marking CCG followed by the same number of words marking CGG.
+const uint64_t CONTEXT_INDEX_MAGIC = 0x58544343514d4142ull;            //"BAMQCCTX" little-endian
+const unsigned CONTEXT_INDEX_HEADER = 4;                                //Number of words in front of contig lengths
+// ---------------------------------------------------------------------------------------
+// Enum ContextType
+// ---------------------------------------------------------------------------------------
+//Reference context of a triplet relevant for the C>A/G>T-Artifact-check.
+enum ContextType
+{
+    CONTEXT_OTHER,
+    CONTEXT_CCG,
+    CONTEXT_CGG
+};
+// ---------------------------------------------------------------------------------------
+// Struct ContextIndex
+// ---------------------------------------------------------------------------------------
+//Memory-mapped context-index and the offset of the bitvectors of each contig within it.
+struct ContextIndex
+{
+    String<uint64_t, MMap<> > words;
+    String<uint64_t> ccgBegin;                  //Offset of the CCG-bitvector of each contig in words
+    String<uint64_t> cggBegin;                  //Offset of the CGG-bitvector of each contig in words
+};
+// ---------------------------------------------------------------------------------------
+// Function getContextIndexPath()
+// ---------------------------------------------------------------------------------------
+//Return the path of the context-index belonging to the reference genome.
+inline CharString getContextIndexPath(const CharString & refFileName)
+{
+    CharString ctxFileName = refFileName;
+    append(ctxFileName, ".ctx");
+    return ctxFileName;
+}
+// ---------------------------------------------------------------------------------------
+// Function getFileStamp()
+// ---------------------------------------------------------------------------------------
+//Write size and modification time of the file to stamp. Return false if the file cannot be accessed.
+inline bool getFileStamp(uint64_t (& stamp) [2], const CharString & fileName)
+{
+    struct stat fileStat;
+    if (stat(toCString(fileName), &fileStat) != 0)
+        return false;
+    stamp[0] = fileStat.st_size;
+    stamp[1] = fileStat.st_mtime;
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function markContexts()
+// ---------------------------------------------------------------------------------------
+//Set the bits of all CCG and CGG triplets starting in seq. offset is the position of the first base of seq on the
+//contig, only triplets lying completely within seq are marked.
+inline void markContexts(String<uint64_t> & ccgBits,
+                         String<uint64_t> & cggBits,
+                         const Dna5String & seq,
+                         uint64_t offset)
+{
+    for (unsigned i = 0; i + 2 < length(seq); ++i)
+    {
+        if (seq[i] != 'C' || seq[i + 2] != 'G')
+            continue;
+        uint64_t pos = offset + i;
+        if (seq[i + 1] == 'C')
+            ccgBits[pos / 64] |= 1ull << (pos % 64);
+        else if (seq[i + 1] == 'G')
+            cggBits[pos / 64] |= 1ull << (pos % 64);
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function buildContextIndex()
+// ---------------------------------------------------------------------------------------
+//Scan the reference genome window-wise and write the context-index to ctxFileName. The index is first written to a
+//temporary file, so that concurrent runs never see an incomplete index. Return false on errors, true otherwise.
+inline bool buildContextIndex(FaiIndex & faiIndex,
+                              const CharString & refFileName,
+                              const CharString & ctxFileName,
+                              uint64_t windowSize = 4194304)
+{
+    uint64_t stamp[2];
+    if (!getFileStamp(stamp, refFileName))
+        return false;
+    CharString tmpFileName = ctxFileName;                              //Unique per process, runs may build it at once
+    append(tmpFileName, "." + std::to_string(getpid()) + ".tmp");
+    std::ofstream out(toCString(tmpFileName), std::ios_base::out | std::ios_base::binary);
+    if (!out.good())
+        return false;
+    String<uint64_t> header;
+    appendValue(header, CONTEXT_INDEX_MAGIC);
+    appendValue(header, stamp[0]);
+    appendValue(header, stamp[1]);
+    appendValue(header, (uint64_t)numSeqs(faiIndex));
+    for (unsigned faiId = 0; faiId < numSeqs(faiIndex); ++faiId)
+        appendValue(header, (uint64_t)sequenceLength(faiIndex, faiId));
+    out.write(reinterpret_cast<const char *>(begin(header, Standard())), length(header) * sizeof(uint64_t));
+    String<uint64_t> ccgBits;
+    String<uint64_t> cggBits;
+    Dna5String window;
+    try
+    {
+        for (unsigned faiId = 0; faiId < numSeqs(faiIndex) && out.good(); ++faiId)
+        {
+            uint64_t contigLength = sequenceLength(faiIndex, faiId);
+            clear(ccgBits);
+            resize(ccgBits, (contigLength + 63) / 64, 0);
+            clear(cggBits);
+            resize(cggBits, (contigLength + 63) / 64, 0);
+            for (uint64_t windowBegin = 0; windowBegin + 2 < contigLength; windowBegin += windowSize)
+            {                                                               //Overlap by two bases to catch triplets
+                uint64_t windowEnd = std::min(windowBegin + windowSize + 2, contigLength);  //spanning windows
+                readRegion(window, faiIndex, faiId, windowBegin, windowEnd);
+                markContexts(ccgBits, cggBits, window, windowBegin);
+            }
+            out.write(reinterpret_cast<const char *>(begin(ccgBits, Standard())), length(ccgBits) * sizeof(uint64_t));
+            out.write(reinterpret_cast<const char *>(begin(cggBits, Standard())), length(cggBits) * sizeof(uint64_t));
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        out.setstate(std::ios_base::failbit);
+    }
+    out.close();
+    if (out.fail() || std::rename(toCString(tmpFileName), toCString(ctxFileName)) != 0)
+    {
+        std::remove(toCString(tmpFileName));
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function openContextIndex()
+// ---------------------------------------------------------------------------------------
+//Map the context-index into memory. Return false if it is missing, damaged or does not belong to the current version
+//of the reference genome, true otherwise.
+inline bool openContextIndex(ContextIndex & ctxIndex,
+                             const FaiIndex & faiIndex,
+                             const CharString & refFileName,
+                             const CharString & ctxFileName)
+{
+    uint64_t stamp[2];
+    uint64_t ctxStamp[2];                       //Only checks if the index exists, opening it would print an error
+    if (!getFileStamp(stamp, refFileName) ||
+        !getFileStamp(ctxStamp, ctxFileName) ||
+        !open(ctxIndex.words, toCString(ctxFileName), OPEN_RDONLY))
+        return false;
+    uint64_t numContigs = numSeqs(faiIndex);
+    const String<uint64_t, MMap<> > & words = ctxIndex.words;
+    if (length(words) < CONTEXT_INDEX_HEADER + numContigs ||
+        words[0] != CONTEXT_INDEX_MAGIC ||
+        words[1] != stamp[0] ||
+        words[2] != stamp[1] ||
+        words[3] != numContigs)
+    {
+        close(ctxIndex.words);
+        return false;
+    }
+    clear(ctxIndex.ccgBegin);
+    clear(ctxIndex.cggBegin);
+    uint64_t offset = CONTEXT_INDEX_HEADER + numContigs;
+    for (unsigned faiId = 0; faiId < numContigs; ++faiId)
+    {
+        uint64_t contigLength = words[CONTEXT_INDEX_HEADER + faiId];
+        if (contigLength != sequenceLength(faiIndex, faiId))
+            break;
+        appendValue(ctxIndex.ccgBegin, offset);
+        offset += (contigLength + 63) / 64;
+        appendValue(ctxIndex.cggBegin, offset);
+        offset += (contigLength + 63) / 64;
+    }
+    if (length(ctxIndex.ccgBegin) != numContigs || offset != length(words))
+    {
+        close(ctxIndex.words);
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function prepareContextIndex()
+// ---------------------------------------------------------------------------------------
+//Make sure an up-to-date context-index of the reference genome exists, build it if it is missing or outdated.
+//Called once before the checks start. Return false if it can neither be loaded nor built, true otherwise.
+inline bool prepareContextIndex(RefIdxMemory & memory, const ProgramOptions & options)
+{
+    ReferenceIndex faiIndex;
+    if (!loadRefIdx(faiIndex, memory, options))
+        return false;
+    ContextIndex ctxIndex;
+    CharString ctxFileName = getContextIndexPath(options.refPath);
+    if (openContextIndex(ctxIndex, faiIndex, options.refPath, ctxFileName))
+        return true;
+    if (options.verbosity)
+        std::cout << "Building context-index " << ctxFileName << "..." << std::endl;
+    if (!buildContextIndex(faiIndex, options.refPath, ctxFileName))
+    {
+        std::cerr << "WARNING: Context-index " << ctxFileName << " could not be built. Reading the reference "
+                  << "instead.\n";
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function loadContextIndex()
+// ---------------------------------------------------------------------------------------
+//Map the context-index prepared by prepareContextIndex() if it was requested. Return false if it is not used.
+inline bool loadContextIndex(ContextIndex & ctxIndex, const FaiIndex & faiIndex, const ProgramOptions & options)
+{
+    if (!options.contextIndex)
+        return false;
+    return openContextIndex(ctxIndex, faiIndex, options.refPath, getContextIndexPath(options.refPath));
+}
+// ---------------------------------------------------------------------------------------
+// Function getContextBit()
+// ---------------------------------------------------------------------------------------
+//Return the bit for position pos of the bitvector starting at offset of the context-index.
+inline bool getContextBit(const ContextIndex & ctxIndex, uint64_t offset, uint64_t pos)
+{
+    return (ctxIndex.words[offset + pos / 64] >> (pos % 64)) & 1;
+}
+#endif /* CONTEXT_INDEX_H_ */
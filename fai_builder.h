@@ -0,0 +1,449 @@
+#ifndef FAI_BUILDER_H_
+#define FAI_BUILDER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <seqan/file.h>
+#include <seqan/seq_io.h>
+#include "bgzf_reference.h"
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Parallel construction of the FAI-index
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Function runTasks()
+// ---------------------------------------------------------------------------------------
+//Call task(i) for i in [0, numTasks) on up to numThreads threads, each taking the next unprocessed task.
+template <typename TTask>
+inline void runTasks(unsigned numTasks, unsigned numThreads, TTask task)
+{
+    std::atomic<unsigned> nextTask(0);
+    auto work = [&]()
+    {
+        for (unsigned i = nextTask++; i < numTasks; i = nextTask++)
+            task(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < std::min(numThreads, numTasks); ++t)
+        threads.push_back(std::thread(work));
+    work();
+    for (std::thread & thread : threads)
+        thread.join();
+}
+// ---------------------------------------------------------------------------------------
+// Function findFastaHeaders()
+// ---------------------------------------------------------------------------------------
+//Append the positions of all '>' beginning a line in [beginPos, endPos) of the FASTA-file data to headers.
+inline void findFastaHeaders(String<uint64_t> & headers, const char * data, uint64_t beginPos, uint64_t endPos)
+{
+    const char * end = data + endPos;
+    for (const char * p = data + beginPos; p < end; ++p)
+    {
+        p = static_cast<const char *>(std::memchr(p, '>', end - p));
+        if (p == NULL)
+            break;
+        if (p == data || p[-1] == '\n')
+            appendValue(headers, p - data);
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function getFastaLayout()
+// ---------------------------------------------------------------------------------------
+//Fill entry for the record with the header at headerPos and ending at recordEnd like SeqAn's build(). The line
+//lengths are taken from the first line of the sequence, which all but the last line must match (see
+//checkFastaLines()). Set contentEnd to the end of the last base of the record, i.e. before the final line breaks.
+inline void getFastaLayout(FaiIndexEntry_ & entry, uint64_t & contentEnd, const char * data, uint64_t headerPos,
+                           uint64_t recordEnd)
+{
+    clear(entry);
+    uint64_t pos = headerPos + 1;
+    while (pos < recordEnd && !IsWhitespace()(data[pos]))
+        ++pos;
+    for (uint64_t namePos = headerPos + 1; namePos < pos; ++namePos)
+        appendValue(entry.name, data[namePos]);
+    const char * lineEnd = static_cast<const char *>(std::memchr(data + pos, '\n', recordEnd - pos));
+    entry.offset = lineEnd == NULL ? recordEnd : lineEnd - data + 1;
+    contentEnd = recordEnd;
+    while (contentEnd > entry.offset && (data[contentEnd - 1] == '\n' || data[contentEnd - 1] == '\r'))
+        --contentEnd;
+    if (contentEnd == entry.offset)                                     //No sequence
+        return;
+    const char * begin = data + entry.offset;
+    lineEnd = static_cast<const char *>(std::memchr(begin, '\n', contentEnd - entry.offset));
+    if (lineEnd == NULL)                                                //Single line, ended by the final line breaks
+    {
+        uint64_t breakEnd = contentEnd;
+        if (breakEnd < recordEnd && data[breakEnd] == '\r')
+            ++breakEnd;
+        if (breakEnd < recordEnd && data[breakEnd] == '\n')
+            ++breakEnd;
+        entry.lineLength = contentEnd - entry.offset;
+        entry.overallLineLength = breakEnd - entry.offset;
+        entry.sequenceLength = entry.lineLength;
+        return;
+    }
+    entry.overallLineLength = lineEnd - begin + 1;
+    entry.lineLength = entry.overallLineLength - 1 - (lineEnd > begin && lineEnd[-1] == '\r');
+    uint64_t fullLines = (contentEnd - 1 - entry.offset) / entry.overallLineLength;
+    entry.sequenceLength = fullLines * entry.lineLength + (contentEnd - entry.offset -
+                                                           fullLines * entry.overallLineLength);  //Plus last line
+}
+// ---------------------------------------------------------------------------------------
+// Function checkFastaLines()
+// ---------------------------------------------------------------------------------------
+//Check the part [beginPos, endPos) of the sequence of the record described by entry and ending at contentEnd: Line
+//breaks must be exactly at the end of each line of entry.lineLength bases, except behind the last line. Return false
+//if the line lengths or line endings are inconsistent, true otherwise.
+inline bool checkFastaLines(const char * data, const FaiIndexEntry_ & entry, uint64_t contentEnd, uint64_t beginPos,
+                            uint64_t endPos)
+{
+    if (entry.overallLineLength == entry.lineLength)                    //Single line without line break
+        return true;
+    uint64_t breakLength = entry.overallLineLength - entry.lineLength;
+    uint64_t fullLines = (contentEnd - 1 - entry.offset) / entry.overallLineLength;
+    uint64_t expected = 0;                                              //Line break characters expected in the part
+    for (uint64_t line = (beginPos - entry.offset) / entry.overallLineLength; line < fullLines; ++line)
+    {
+        uint64_t lineBreak = entry.offset + line * entry.overallLineLength + entry.lineLength;
+        if (lineBreak >= endPos)
+            break;
+        for (uint64_t pos = lineBreak; pos < lineBreak + breakLength; ++pos)
+        {
+            if (pos < beginPos || pos >= endPos)
+                continue;
+            if (data[pos] != (pos + 1 == lineBreak + breakLength ? '\n' : '\r'))
+                return false;
+            ++expected;
+        }
+    }
+    uint64_t found = 0;
+    for (const char * p = data + beginPos; p < data + endPos; ++p)
+        found += (*p == '\n') | (*p == '\r');
+    return found == expected;
+}
+// ---------------------------------------------------------------------------------------
+// Function indexMappedFasta()
+// ---------------------------------------------------------------------------------------
+//Fill entries for the FASTA-file data of size bytes, using up to numThreads threads: The file is searched for
+//headers in chunks of chunkSize bytes, then the line lengths of each record are checked in parts of the same size.
+//Return false if a record has inconsistent line lengths or line endings, true otherwise.
+inline bool indexMappedFasta(String<FaiIndexEntry_> & entries,
+                             const char * data,
+                             uint64_t size,
+                             unsigned numThreads,
+                             uint64_t chunkSize)
+{
+    unsigned numChunks = (size + chunkSize - 1) / chunkSize;
+    std::vector<String<uint64_t> > chunkHeaders(numChunks);
+    runTasks(numChunks, numThreads, [&](unsigned c)
+    {
+        findFastaHeaders(chunkHeaders[c], data, c * chunkSize, std::min((c + 1) * chunkSize, size));
+    });
+    String<uint64_t> headers;
+    for (const String<uint64_t> & chunk : chunkHeaders)
+        append(headers, chunk);
+    String<uint64_t> contentEnds;                                       //Record layouts from their first line
+    resize(entries, length(headers));
+    resize(contentEnds, length(headers));
+    String<Triple<unsigned, uint64_t, uint64_t> > parts;                //Record, begin and end of each part to check
+    for (unsigned r = 0; r < length(headers); ++r)
+    {
+        getFastaLayout(entries[r], contentEnds[r], data, headers[r], r + 1 < length(headers) ? headers[r + 1] : size);
+        for (uint64_t pos = entries[r].offset; pos < contentEnds[r]; pos += chunkSize)
+            appendValue(parts, Triple<unsigned, uint64_t, uint64_t>(r, pos, std::min(pos + chunkSize, contentEnds[r])));
+    }
+    std::atomic<int> inconsistent(-1);
+    runTasks(length(parts), numThreads, [&](unsigned p)
+    {
+        const Triple<unsigned, uint64_t, uint64_t> & part = parts[p];
+        if (!checkFastaLines(data, entries[part.i1], contentEnds[part.i1], part.i2, part.i3))
+            inconsistent = part.i1;
+    });
+    if (inconsistent < 0)
+        return true;
+    std::cerr << "Error: Record " << entries[inconsistent.load()].name
+              << " has inconsistent line lengths or line endings.\n";
+    return false;
+}
+// ---------------------------------------------------------------------------------------
+// Struct FastaScanner
+// ---------------------------------------------------------------------------------------
+//State of the sequential scan of a FASTA-file passed in pieces, e.g. decompressed block by block. It follows the
+//rules of the scan of a mapped file: All lines of a record but the last non-empty one must have the length and line
+//ending of the first, the last one must not be longer and may only be followed by empty lines.
+struct FastaScanner
+{
+    enum State
+    {
+        PREAMBLE,                               //In front of the first header
+        NAME,                                   //Name in the header
+        HEADER,                                 //Rest of the header line
+        SEQUENCE
+    };
+
+    String<FaiIndexEntry_> entries;
+    State state = PREAMBLE;
+    uint64_t pos = 0;                           //Position of the next piece in the file
+    bool lineStart = true;
+    uint64_t lineBytes = 0;                     //Bytes of the current line so far, without the '\n'
+    uint64_t lineCRs = 0;                       //Number of '\r' in the current line so far
+    bool lineEndsCR = false;
+    unsigned contentLines = 0;                  //Non-empty lines of the current record
+    bool emptyLine = false;                     //An empty line has been seen in the current record
+    uint64_t lastLength = 0;                    //Bases in the last non-empty line
+    bool lastCR = false;
+    bool firstCR = false;
+    CharString inconsistent;                    //First record with inconsistent lines
+};
+// ---------------------------------------------------------------------------------------
+// Function endFastaLine()
+// ---------------------------------------------------------------------------------------
+//Check the completed sequence line of the current record and add its bases. terminated is false for a last line
+//not followed by '\n'.
+inline void endFastaLine(FastaScanner & scanner, bool terminated)
+{
+    FaiIndexEntry_ & entry = back(scanner.entries);
+    bool cr = scanner.lineEndsCR;
+    uint64_t bases = scanner.lineBytes - cr;
+    bool consistent = scanner.lineCRs == (uint64_t)cr;                  //No '\r' within the line
+    scanner.lineBytes = 0;
+    scanner.lineCRs = 0;
+    scanner.lineEndsCR = false;
+    if (bases == 0)
+    {
+        scanner.emptyLine = true;
+    }
+    else
+    {
+        if (scanner.emptyLine)                                          //Non-empty line behind an empty one
+            consistent = false;
+        if (scanner.contentLines == 0)
+        {
+            entry.lineLength = bases;
+            entry.overallLineLength = bases + cr + terminated;
+            scanner.firstCR = cr;
+        }
+        else if (scanner.lastLength != entry.lineLength || scanner.lastCR != scanner.firstCR)
+        {
+            consistent = false;                                         //Previous line turned out not to be the last
+        }
+        scanner.lastLength = bases;
+        scanner.lastCR = cr;
+        ++scanner.contentLines;
+        entry.sequenceLength += bases;
+    }
+    if (!consistent && empty(scanner.inconsistent))
+        scanner.inconsistent = entry.name;
+}
+// ---------------------------------------------------------------------------------------
+// Function endFastaRecord()
+// ---------------------------------------------------------------------------------------
+//Complete the current record, if any, at position pos of the file.
+inline void endFastaRecord(FastaScanner & scanner, uint64_t pos)
+{
+    if (scanner.state == FastaScanner::PREAMBLE)
+        return;
+    if (scanner.state != FastaScanner::SEQUENCE)                       //Header without line break at the end
+        back(scanner.entries).offset = pos;
+    else if (scanner.lineBytes > 0)
+        endFastaLine(scanner, false);
+    if (scanner.contentLines > 1 && scanner.lastLength > back(scanner.entries).lineLength &&
+        empty(scanner.inconsistent))
+        scanner.inconsistent = back(scanner.entries).name;
+    scanner.contentLines = 0;
+    scanner.emptyLine = false;
+}
+// ---------------------------------------------------------------------------------------
+// Function scanFasta()
+// ---------------------------------------------------------------------------------------
+//Continue the scan with the next length bytes of the FASTA-file.
+inline void scanFasta(FastaScanner & scanner, const char * data, uint64_t length)
+{
+    const char * end = data + length;
+    const char * p = data;
+    while (p < end)
+    {
+        if (scanner.lineStart && *p == '>' &&
+            (scanner.state == FastaScanner::PREAMBLE || scanner.state == FastaScanner::SEQUENCE))
+        {
+            endFastaRecord(scanner, scanner.pos + (p - data));
+            appendValue(scanner.entries, FaiIndexEntry_());
+            clear(back(scanner.entries));
+            scanner.state = FastaScanner::NAME;
+            scanner.lineStart = false;
+            ++p;
+            continue;
+        }
+        const char * lineEnd = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        const char * stop = lineEnd == NULL ? end : lineEnd;
+        if (scanner.state == FastaScanner::NAME)
+        {
+            const char * nameEnd = p;
+            while (nameEnd < stop && !IsWhitespace()(*nameEnd))
+                ++nameEnd;
+            for (const char * c = p; c < nameEnd; ++c)
+                appendValue(back(scanner.entries).name, *c);
+            if (nameEnd < stop)
+                scanner.state = FastaScanner::HEADER;
+        }
+        else if (scanner.state == FastaScanner::SEQUENCE && stop > p)
+        {
+            scanner.lineBytes += stop - p;
+            scanner.lineCRs += std::count(p, stop, '\r');
+            scanner.lineEndsCR = stop[-1] == '\r';
+        }
+        if (lineEnd == NULL)
+        {
+            scanner.lineStart = false;
+            break;
+        }
+        if (scanner.state == FastaScanner::SEQUENCE)
+        {
+            endFastaLine(scanner, true);
+        }
+        else if (scanner.state != FastaScanner::PREAMBLE)
+        {
+            back(scanner.entries).offset = scanner.pos + (lineEnd - data) + 1;
+            scanner.state = FastaScanner::SEQUENCE;
+        }
+        scanner.lineStart = true;
+        p = lineEnd + 1;
+    }
+    scanner.pos += length;
+}
+// ---------------------------------------------------------------------------------------
+// Function indexBgzfFasta()
+// ---------------------------------------------------------------------------------------
+//Fill entries for the BGZF-compressed FASTA-file fastaFileName. Batches of batchBlocks blocks are decompressed by up
+//to numThreads threads and scanned in order. Return false on errors, true otherwise.
+inline bool indexBgzfFasta(String<FaiIndexEntry_> & entries,
+                           const CharString & fastaFileName,
+                           unsigned numThreads,
+                           unsigned batchBlocks = 1024)
+{
+    BgzfBlockIndex blocks;
+    int fd = ::open(toCString(fastaFileName), O_RDONLY);
+    if (fd < 0 || !buildGzi(blocks, fastaFileName))
+    {
+        if (fd >= 0)
+            ::close(fd);
+        std::cerr << "Error: Could not read the BGZF-blocks of " << fastaFileName << ".\n";
+        return false;
+    }
+    uint64_t numBlocks = length(blocks.compressed) - 1;
+    std::vector<char> batch((uint64_t)batchBlocks * BGZF_MAX_BLOCK_SIZE);
+    FastaScanner scanner;
+    std::atomic<bool> ok(true);
+    for (uint64_t first = 0; first < numBlocks && ok; first += batchBlocks)
+    {
+        uint64_t last = std::min(first + batchBlocks, numBlocks);
+        runTasks(last - first, numThreads, [&](unsigned b)
+        {
+            std::vector<char> compressed;
+            try
+            {
+                readBgzfBlock(&batch[blocks.uncompressed[first + b] - blocks.uncompressed[first]], compressed, fd,
+                              blocks, first + b);
+            }
+            catch (Exception const &)
+            {
+                ok = false;
+            }
+        });
+        scanFasta(scanner, &batch[0], blocks.uncompressed[last] - blocks.uncompressed[first]);
+    }
+    ::close(fd);
+    if (!ok)
+    {
+        std::cerr << "Error: Could not decompress " << fastaFileName << ".\n";
+        return false;
+    }
+    endFastaRecord(scanner, scanner.pos);
+    if (!empty(scanner.inconsistent))
+    {
+        std::cerr << "Error: Record " << scanner.inconsistent << " has inconsistent line lengths or line endings.\n";
+        return false;
+    }
+    entries = scanner.entries;
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function buildRefIdx()
+// ---------------------------------------------------------------------------------------
+//Build the FAI-index of the FASTA-file fastaFileName in memory, using up to numThreads threads on chunks of
+//chunkSize bytes. Plain files are memory-mapped and scanned in parallel, BGZF-compressed ones are decompressed in
+//parallel and scanned sequentially. Files which cannot be mapped, e.g. pipes, are indexed by SeqAn's build(). The
+//index is not saved, its file name is set to faiFileName. Return false on errors, true otherwise.
+inline bool buildRefIdx(FaiIndex & faiIndex, const CharString & fastaFileName, const CharString & faiFileName,
+                        unsigned numThreads, uint64_t chunkSize = 67108864)
+{
+    if (faiIndex.file.is_open())
+        faiIndex.file.close();
+    clear(faiIndex);
+    String<FaiIndexEntry_> entries;
+    struct stat fileStat;
+    FileMapping<> mapping;
+    if (isBgzfFile(fastaFileName))
+    {
+        if (!indexBgzfFasta(entries, fastaFileName, numThreads, std::max<uint64_t>(chunkSize / BGZF_MAX_BLOCK_SIZE, 1)))
+            return false;
+    }
+    else if (stat(toCString(fastaFileName), &fileStat) != 0 || !S_ISREG(fileStat.st_mode) || fileStat.st_size == 0 ||
+             !open(mapping, toCString(fastaFileName), OPEN_RDONLY))
+    {
+        return build(faiIndex, toCString(fastaFileName), toCString(faiFileName));
+    }
+    else
+    {
+        uint64_t size = length(mapping);
+        const char * data = static_cast<const char *>(mapFileSegment(mapping, 0, size, MAP_RDONLY));
+        if (data == NULL)
+        {
+            close(mapping);
+            return build(faiIndex, toCString(fastaFileName), toCString(faiFileName));
+        }
+        bool gzip = size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b;
+        adviseFileSegment(mapping, MAP_WILLNEED, const_cast<char *>(data), 0, size);
+        bool ok = !gzip && indexMappedFasta(entries, data, size, numThreads, chunkSize);
+        unmapFileSegment(mapping, const_cast<char *>(data), size);
+        close(mapping);
+        if (gzip)
+            std::cerr << "Error: " << fastaFileName << " is compressed with gzip, which does not allow random access. "
+                      << "Compress it with bgzip instead.\n";
+        if (!ok)
+            return false;
+    }
+    faiIndex.fastaFilename = fastaFileName;
+    faiIndex.faiFilename = faiFileName;
+    if (!open(faiIndex.file, toCString(fastaFileName), OPEN_RDONLY))
+        return false;
+    for (const FaiIndexEntry_ & entry : entries)
+        appendValue(faiIndex.seqNameStore, entry.name);
+    faiIndex.indexEntryStore = entries;
+    refresh(faiIndex.seqNameStoreCache);
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function copyRefIdx()
+// ---------------------------------------------------------------------------------------
+//Make target a copy of the FAI-index source with its own handle of the FASTA-file. Return false if the FASTA-file
+//cannot be opened, true otherwise.
+inline bool copyRefIdx(FaiIndex & target, const FaiIndex & source)
+{
+    if (target.file.is_open())
+        target.file.close();
+    clear(target);
+    target.fastaFilename = source.fastaFilename;
+    target.faiFilename = source.faiFilename;
+    target.indexEntryStore = source.indexEntryStore;
+    target.seqNameStore = source.seqNameStore;
+    refresh(target.seqNameStoreCache);
+    return open(target.file, toCString(target.fastaFilename), OPEN_RDONLY);
+}
+#endif /* FAI_BUILDER_H_ */
@@ -0,0 +1,117 @@
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <algorithm>
+#include <streambuf>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <seqan/file.h>
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Memory-mapped input
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Class MappedFileBuffer
+// ---------------------------------------------------------------------------------------
+//Read-only stream buffer directly on a memory-mapped file. Reading copies the bytes straight out of the page cache
+//without read()-calls or an intermediate buffer. The get area is moved window-wise over the mapping, each time a new
+//window is entered the kernel is asked to read ahead the following one.
+class MappedFileBuffer : public std::streambuf
+{
+public:
+    FileMapping<> mapping;
+    char * data = NULL;                         //Begin of the mapped file, NULL if nothing is mapped
+    uint64_t size = 0;                          //Length of the mapped file
+    uint64_t windowSize = 8388608;              //Number of bytes made available and read ahead at once
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+    MappedFileBuffer() {}
+    MappedFileBuffer(const MappedFileBuffer &) = delete;
+    MappedFileBuffer & operator=(const MappedFileBuffer &) = delete;
+
+    ~MappedFileBuffer()
+    {
+        if (data != NULL)
+        {
+            unmapFileSegment(mapping, data, size);
+            close(mapping);
+        }
+    }
+
+    //Make the window beginning at pos the get area and read ahead the window behind it. After seeking, windows are not
+    //page-aligned, so the read-ahead begins at the page holding the end of the window, as the kernel rejects hints on
+    //unaligned addresses. Return false if the hint was rejected, true otherwise.
+    bool setWindow(uint64_t pos)
+    {
+        uint64_t windowEnd = std::min(pos + windowSize, size);
+        setg(data, data + pos, data + windowEnd);
+        if (windowEnd >= size)
+            return true;
+        uint64_t aheadBegin = windowEnd & ~(pageSize - 1);
+        uint64_t aheadEnd = std::min(windowEnd + windowSize, size);
+        return adviseFileSegment(mapping, MAP_WILLNEED, data, aheadBegin, aheadEnd - aheadBegin);
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        uint64_t pos = egptr() - data;
+        if (pos >= size)
+            return traits_type::eof();
+        setWindow(pos);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize showmanyc()
+    {
+        return size - (gptr() - data);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which & std::ios_base::in) || data == NULL)
+            return pos_type(off_type(-1));
+        off_type pos = off;
+        if (dir == std::ios_base::cur)
+            pos += gptr() - data;
+        else if (dir == std::ios_base::end)
+            pos += size;
+        if (pos < 0 || (uint64_t)pos > size)
+            return pos_type(off_type(-1));
+        setWindow(pos);
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Function openMappedFile()
+// ---------------------------------------------------------------------------------------
+//Map the regular, non-empty file fileName into memory for sequential reading. Return false if it cannot be mapped,
+//true otherwise.
+inline bool openMappedFile(MappedFileBuffer & buffer, const CharString & fileName)
+{
+    struct stat fileStat;                       //Only maps regular files, opening others would print an error
+    if (stat(toCString(fileName), &fileStat) != 0 || !S_ISREG(fileStat.st_mode) || fileStat.st_size == 0)
+        return false;
+    if (!open(buffer.mapping, toCString(fileName), OPEN_RDONLY))
+        return false;
+    buffer.size = length(buffer.mapping);
+    buffer.data = static_cast<char *>(mapFileSegment(buffer.mapping, 0, buffer.size, MAP_RDONLY));
+    if (buffer.data == NULL)
+    {
+        close(buffer.mapping);
+        return false;
+    }
+    adviseFileSegment(buffer.mapping, MAP_SEQUENTIAL, buffer.data, 0, buffer.size);
+    buffer.setWindow(0);
+    return true;
+}
+#endif /* MAPPED_FILE_H_ */
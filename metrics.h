@@ -0,0 +1,453 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <sstream>
+#include <tuple>
+#include <utility>
+#include "BAMQC.h"
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// QC metric modules
+// ---------------------------------------------------------------------------------------
+//Each check is a metric module: a struct holding its counters and buffers and the following functions:
+//initMetric()      prepare the module for one thread
+//needsSequence()   return true if the module needs more than the fixed-length fields of the records
+//consumeBatch()    count all records of a batch passing checkRecord()
+//mergeMetric()     add the counts of another thread
+//finalizeMetric()  format the report
+//writeMetric()     write the report
+//The engine (QCEngine) is composed of the enabled modules at compile time, checks each batch once and hands it to all
+//of them without any dispatch at runtime. A new metric only needs these functions and an instantiation in main().
+// ---------------------------------------------------------------------------------------
+// Struct RecordBatch
+// ---------------------------------------------------------------------------------------
+//Records processed at once, stored column-wise so that the checks on the fixed-length fields can be vectorized.
+//Complete records are only decoded if a module needs them. Batches are reused and keep their memory.
+struct RecordBatch
+{
+    unsigned size = 0;                          //Number of records filled by the reader
+    String<uint16_t> flag;
+    String<uint8_t> mapQ;
+    String<int32_t> rID;
+    String<int32_t> beginPos;
+    String<int32_t> tLen;
+    String<uint8_t> valid;                      //1 if the record passes checkRecord(), set by consumeBatch()
+    String<BamAlignmentRecord> records;         //Complete records, only filled if fullRecords is set
+};
+// ---------------------------------------------------------------------------------------
+// Function reserveRecord()
+// ---------------------------------------------------------------------------------------
+//Reserve memory for the payload of a typical short-read record. readRecord() grows the strings of a record exactly to
+//the size needed, so without reserving, records of a reused batch are reallocated whenever a longer one is read.
+inline void reserveRecord(BamAlignmentRecord & record)
+{
+    reserve(record.qName, 64, Exact());
+    reserve(record.cigar, 16, Exact());
+    reserve(record.seq, 256, Exact());
+    reserve(record.qual, 256, Exact());
+    reserve(record.tags, 256, Exact());
+}
+// ---------------------------------------------------------------------------------------
+// Function resizeBatch()
+// ---------------------------------------------------------------------------------------
+//Make room for batchSize records in the columns and, if fullRecords is set, for the complete records.
+inline void resizeBatch(RecordBatch & batch, unsigned batchSize, bool fullRecords)
+{
+    if (length(batch.flag) < batchSize)
+    {
+        resize(batch.flag, batchSize);
+        resize(batch.mapQ, batchSize);
+        resize(batch.rID, batchSize);
+        resize(batch.beginPos, batchSize);
+        resize(batch.tLen, batchSize);
+    }
+    if (fullRecords && length(batch.records) < batchSize)
+    {
+        unsigned oldSize = length(batch.records);
+        resize(batch.records, batchSize);
+        for (unsigned i = oldSize; i < batchSize; ++i)
+            reserveRecord(batch.records[i]);
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function readBatchRecord()
+// ---------------------------------------------------------------------------------------
+//Read the next record into position batch.size of the batch without increasing batch.size. Only the fixed-length
+//fields are read if fullRecords is false, which requires a BAM-file.
+inline void readBatchRecord(RecordBatch & batch, BamFileIn & bamFile, bool fullRecords)
+{
+    unsigned i = batch.size;
+    BamAlignmentRecordCore core;
+    BamAlignmentRecordCore * fields = &core;
+    if (fullRecords)
+    {
+        readRecord(batch.records[i], bamFile);
+        fields = &batch.records[i];
+    }
+    else
+    {
+        readRecordCore(core, bamFile);                                  //Only flag, mapQ, rID, beginPos and tLen
+    }
+    batch.flag[i] = fields->flag;
+    batch.mapQ[i] = fields->mapQ;
+    batch.rID[i] = fields->rID;
+    batch.beginPos[i] = fields->beginPos;
+    batch.tLen[i] = fields->tLen;
+}
+// ---------------------------------------------------------------------------------------
+// Function readBatch()
+// ---------------------------------------------------------------------------------------
+//Fill the batch with up to batchSize records. Only the fixed-length fields are read if fullRecords is false.
+inline void readBatch(RecordBatch & batch, BamFileIn & bamFile, unsigned batchSize, bool fullRecords)
+{
+    fullRecords = fullRecords || !isEqual(format(bamFile), Bam());    //SAM-records are always decoded completely
+    resizeBatch(batch, batchSize, fullRecords);
+    for (batch.size = 0; batch.size < batchSize && !atEnd(bamFile); ++batch.size)
+        readBatchRecord(batch, bamFile, fullRecords);
+}
+// ---------------------------------------------------------------------------------------
+// Insert-size module
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Struct InsertSizeMetric
+// ---------------------------------------------------------------------------------------
+struct InsertSizeMetric
+{
+    TInsertDistr counts;
+    TInsertTail tail;                           //Inserts longer than options.maxInsert
+    std::stringstream report;
+};
+// ---------------------------------------------------------------------------------------
+// Function initMetric()
+// ---------------------------------------------------------------------------------------
+inline bool initMetric(InsertSizeMetric & metric,
+                       const StringSet<CharString> & /*contigNameStore*/,
+                       RefIdxMemory & /*refIdxMemory*/,
+                       const ProgramOptions & options)
+{
+    resize(metric.counts, options.maxInsert + 1, 0);
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function needsSequence()
+// ---------------------------------------------------------------------------------------
+inline bool needsSequence(const InsertSizeMetric & /*metric*/)
+{
+    return false;
+}
+// ---------------------------------------------------------------------------------------
+// Function consumeBatch()
+// ---------------------------------------------------------------------------------------
+inline void consumeBatch(InsertSizeMetric & metric, RecordBatch & batch, const ProgramOptions & options)
+{
+    countInsertSizes(metric.counts, metric.tail, batch.tLen, batch.valid, batch.size, options);
+}
+// ---------------------------------------------------------------------------------------
+// Function mergeMetric()
+// ---------------------------------------------------------------------------------------
+inline void mergeMetric(InsertSizeMetric & metric, const InsertSizeMetric & other)
+{
+    if (length(metric.counts) < length(other.counts))
+        resize(metric.counts, length(other.counts), 0);
+    for (unsigned i = 0; i < length(other.counts); ++i)
+        metric.counts[i] += other.counts[i];
+    if (length(metric.tail) < length(other.tail))
+        resize(metric.tail, length(other.tail), 0);
+    for (unsigned i = 0; i < length(other.tail); ++i)
+        metric.tail[i] += other.tail[i];
+}
+// ---------------------------------------------------------------------------------------
+// Function finalizeMetric()
+// ---------------------------------------------------------------------------------------
+inline void finalizeMetric(InsertSizeMetric & metric, const ProgramOptions & /*options*/)
+{
+    Pair<unsigned, unsigned> firstLast = getFirstLast(metric.counts); //get borders of distribution for clean output
+    formatStats(metric.report, metric.counts, metric.tail, firstLast);
+}
+// ---------------------------------------------------------------------------------------
+// Function writeMetric()
+// ---------------------------------------------------------------------------------------
+inline bool writeMetric(const InsertSizeMetric & metric, const ProgramOptions & options)
+{
+    return writeStats(metric.report, options.outPathInserts);
+}
+// ---------------------------------------------------------------------------------------
+// C>A/G>T-Artifact module
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Struct ConversionMetric
+// ---------------------------------------------------------------------------------------
+//The padding keeps the conversion tables of different threads on separate cache lines.
+struct ConversionMetric
+{
+    char padFront[SEQAN_CACHE_LINE_SIZE];
+    TConvTable artifactConv = {{0}};                                 //table for all artifacual conversions
+    TConvTable normalConv = {{0}};                                   //table for all non-artifactual conversions
+    char padBack[SEQAN_CACHE_LINE_SIZE];
+    const StringSet<CharString> * contigNameStore = NULL;           //Contig names of the BAM-header
+    ReferenceIndex faiIndex;                    //Stays empty if only the MD-tag is used
+    ContextIndex ctxIndex;
+    PackedReference packedRef;
+    ReferenceCache refCache;                    //Window of the current contig, points to ctxIndex and packedRef
+    MDReference mdRef;                          //Reference reconstructed from the MD-tag
+    String<unsigned> occ;                       //positions of artifacual triplets
+    String<unsigned> nocc;                      //positions of non-artifactual triplets
+    Dna5String ref;                             //Will hold triplet of reference after call of getRefAt
+    ContigMap contigMap;                        //FAI-id of each contig of the BAM-header
+    unsigned faiId = 0;                         //FAI-id of the contig of the current record
+    std::stringstream report;
+};
+// ---------------------------------------------------------------------------------------
+// Function initMetric()
+// ---------------------------------------------------------------------------------------
+inline bool initMetric(ConversionMetric & metric,
+                       const StringSet<CharString> & contigNameStore,
+                       RefIdxMemory & refIdxMemory,
+                       const ProgramOptions & options)
+{
+    metric.contigNameStore = &contigNameStore;
+    if (!empty(options.refPath) && !loadRefIdx(metric.faiIndex, refIdxMemory, options))
+        return false;
+    mapContigs(metric.contigMap, contigNameStore, metric.faiIndex);
+    if (loadContextIndex(metric.ctxIndex, metric.faiIndex, options))
+        metric.refCache.ctxIndex = &metric.ctxIndex;
+    if (loadPackedReference(metric.packedRef, metric.faiIndex, options))
+        metric.refCache.packedRef = &metric.packedRef;
+    metric.mdRef.enabled = options.mdTag;
+    reserve(metric.occ, 5);
+    reserve(metric.nocc, 5);
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function needsSequence()
+// ---------------------------------------------------------------------------------------
+inline bool needsSequence(const ConversionMetric & /*metric*/)
+{
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function consumeBatch()
+// ---------------------------------------------------------------------------------------
+inline void consumeBatch(ConversionMetric & metric, RecordBatch & batch, const ProgramOptions & options)
+{
+    for (unsigned i = 0; i < batch.size; ++i)
+    {
+        if (!batch.valid[i])
+            continue;
+        BamAlignmentRecord & record = batch.records[i];
+        if (!checkAndSkip(metric.faiId, metric.contigMap, record, *metric.contigNameStore, options))
+            continue;
+        if (!findNextTriplet(metric.occ, metric.nocc, record))
+            continue;
+        countConversions(metric.artifactConv,
+                         metric.normalConv,
+                         metric.ref,
+                         metric.refCache,
+                         metric.mdRef,
+                         metric.faiIndex,
+                         metric.occ,
+                         metric.nocc,
+                         record,
+                         metric.faiId);
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function mergeMetric()
+// ---------------------------------------------------------------------------------------
+inline void mergeMetric(ConversionMetric & metric, const ConversionMetric & other)
+{
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        for (unsigned j = 0; j < 2; ++j)
+        {
+            metric.artifactConv[i][j] += other.artifactConv[i][j];
+            metric.normalConv[i][j] += other.normalConv[i][j];
+        }
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function finalizeMetric()
+// ---------------------------------------------------------------------------------------
+inline void finalizeMetric(ConversionMetric & metric, const ProgramOptions & /*options*/)
+{
+    formatArtifacts(metric.report, metric.artifactConv, metric.normalConv);
+}
+// ---------------------------------------------------------------------------------------
+// Function writeMetric()
+// ---------------------------------------------------------------------------------------
+inline bool writeMetric(const ConversionMetric & metric, const ProgramOptions & options)
+{
+    return writeStats(metric.report, options.outPathArtifacts);
+}
+// ---------------------------------------------------------------------------------------
+// Engine
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Struct QCEngine
+// ---------------------------------------------------------------------------------------
+//The metric modules of one thread. Only the modules listed in TMetrics are instantiated, so no check of the options
+//is left per record. Must not be copied after initEngine(), the modules keep pointers to their own members.
+template <typename... TMetrics>
+struct QCEngine
+{
+    std::tuple<TMetrics...> metrics;
+    uint64_t records = 0;                       //Number of records consumed
+};
+// ---------------------------------------------------------------------------------------
+// Function forEachMetric()
+// ---------------------------------------------------------------------------------------
+//Call f on each module of the tuple in order. Expanded at compile time.
+template <typename TMetricTuple, typename TFunctor, std::size_t... I>
+inline void forEachMetric(TMetricTuple & metrics, TFunctor && f, std::index_sequence<I...>)
+{
+    int expand[] = {0, (f(std::get<I>(metrics)), 0)...};
+    (void)expand;
+}
+//Call f on each pair of corresponding modules of both tuples in order.
+template <typename TMetricTuple, typename TOtherTuple, typename TFunctor, std::size_t... I>
+inline void forEachMetric(TMetricTuple & metrics, TOtherTuple & others, TFunctor && f, std::index_sequence<I...>)
+{
+    int expand[] = {0, (f(std::get<I>(metrics), std::get<I>(others)), 0)...};
+    (void)expand;
+}
+// ---------------------------------------------------------------------------------------
+// Function getMetric()
+// ---------------------------------------------------------------------------------------
+//Return the module of type TMetric of the engine.
+template <typename TMetric, typename... TMetrics>
+inline TMetric & getMetric(QCEngine<TMetrics...> & engine)
+{
+    return std::get<TMetric>(engine.metrics);
+}
+// ---------------------------------------------------------------------------------------
+// Function initEngine()
+// ---------------------------------------------------------------------------------------
+//Prepare all modules. contigNameStore holds the contig names from the header of the BAM-file and must outlive the
+//engine. Return false on errors, true otherwise.
+template <typename... TMetrics>
+inline bool initEngine(QCEngine<TMetrics...> & engine,
+                       const StringSet<CharString> & contigNameStore,
+                       RefIdxMemory & refIdxMemory,
+                       const ProgramOptions & options)
+{
+    bool ok = true;
+    forEachMetric(engine.metrics, [&](auto & metric)
+    {
+        ok = ok && initMetric(metric, contigNameStore, refIdxMemory, options);
+    }, std::index_sequence_for<TMetrics...>());
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Function needsSequence()
+// ---------------------------------------------------------------------------------------
+//Return true if any module needs the complete records.
+template <typename... TMetrics>
+inline bool needsSequence(const QCEngine<TMetrics...> & engine)
+{
+    bool needed = false;
+    forEachMetric(engine.metrics, [&](const auto & metric)
+    {
+        needed = needed || needsSequence(metric);
+    }, std::index_sequence_for<TMetrics...>());
+    return needed;
+}
+// ---------------------------------------------------------------------------------------
+// Function consumeBatch()
+// ---------------------------------------------------------------------------------------
+//Check all records of the batch once and hand the batch to all modules.
+template <typename... TMetrics>
+inline void consumeBatch(QCEngine<TMetrics...> & engine, RecordBatch & batch, const ProgramOptions & options)
+{
+    engine.records += batch.size;
+    checkRecords(batch.valid, batch.flag, batch.mapQ, batch.size, options);
+    forEachMetric(engine.metrics, [&](auto & metric)
+    {
+        consumeBatch(metric, batch, options);
+    }, std::index_sequence_for<TMetrics...>());
+}
+// ---------------------------------------------------------------------------------------
+// Function mergeEngine()
+// ---------------------------------------------------------------------------------------
+//Add the counts of the engine of another thread.
+template <typename... TMetrics>
+inline void mergeEngine(QCEngine<TMetrics...> & engine, const QCEngine<TMetrics...> & other)
+{
+    engine.records += other.records;
+    forEachMetric(engine.metrics, other.metrics, [](auto & metric, const auto & otherMetric)
+    {
+        mergeMetric(metric, otherMetric);
+    }, std::index_sequence_for<TMetrics...>());
+}
+// ---------------------------------------------------------------------------------------
+// Function writeEngine()
+// ---------------------------------------------------------------------------------------
+//Finalize and write the reports of all modules. Return false on errors, true otherwise.
+template <typename... TMetrics>
+inline bool writeEngine(QCEngine<TMetrics...> & engine, const ProgramOptions & options)
+{
+    bool ok = true;
+    forEachMetric(engine.metrics, [&](auto & metric)
+    {
+        finalizeMetric(metric, options);
+        ok = ok && writeMetric(metric, options);
+    }, std::index_sequence_for<TMetrics...>());
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Allocation statistics
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Function allocationCounter()
+// ---------------------------------------------------------------------------------------
+//Number of calls to operator new. Only counted if BAMQC is built with -DBAMQC_ALLOC_STATS, see BAMQC.cpp.
+inline std::atomic<uint64_t> & allocationCounter()
+{
+    static std::atomic<uint64_t> counter(0);
+    return counter;
+}
+// ---------------------------------------------------------------------------------------
+// Function reportAllocations()
+// ---------------------------------------------------------------------------------------
+//Print the number of allocations since allocationsBegin per record consumed by the engine, so that allocations in the
+//loop over the records become visible.
+template <typename TEngine>
+inline void reportAllocations(const TEngine & engine, uint64_t allocationsBegin)
+{
+    uint64_t allocations = allocationCounter() - allocationsBegin;
+    std::cout << "Allocations: " << allocations << " for " << engine.records << " records ("
+              << (double)allocations / std::max(engine.records, (uint64_t)1) << " per record)" << std::endl;
+}
+// ---------------------------------------------------------------------------------------
+// Function wrapProcess()
+// ---------------------------------------------------------------------------------------
+//Wrapper for performing the selected checks on all records of the BAM-file with a single thread.
+//Return false on errors, true otherwise.
+template <typename TEngine>
+inline bool wrapProcess(TEngine & engine,
+                        BamFileIn & bamFile,
+                        RefIdxMemory & refIdxMemory,
+                        const ProgramOptions & options,
+                        unsigned batchSize = 1024)
+{
+    if (!initEngine(engine, contigNames(context(bamFile)), refIdxMemory, options))
+        return false;
+    RecordBatch batch;
+    try
+    {
+        while (!atEnd(bamFile))
+        {
+            readBatch(batch, bamFile, batchSize, needsSequence(engine));
+            consumeBatch(engine, batch, options);
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif /* METRICS_H_ */
@@ -0,0 +1,328 @@
+#ifndef PACKED_REFERENCE_H_
+#define PACKED_REFERENCE_H_
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <seqan/file.h>
+#include "context_index.h"
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// 2-bit packed reference genome
+// ---------------------------------------------------------------------------------------
+//The packed reference (REFERENCE.packed) holds the bases of all contigs of the reference genome with 2 bits per base
+//(A, C, G, T as 0 to 3, 32 bases per word, first base in the lowest bits). All other bases (N and IUPAC-codes, as in
+//a Dna5String) are stored as runs [begin, end), the bases packed in their place are A. Layout in 64-bit words:
+//magic, size of FASTA-file, mtime of FASTA-file, number of contigs, then for each contig (in FAI-order) its length,
+//the offset of its bases, the offset of its N-runs and their number, followed by the bases and the N-runs of all
+//contigs. Lookups only read the memory-mapping, which is shared between all processes using the same file.
+const uint64_t PACKED_REFERENCE_MAGIC = 0x324b5043514d4142ull;         //"BAMQCPK2" little-endian
+const unsigned PACKED_REFERENCE_HEADER = 4;                             //Number of words in front of the contig table
+const unsigned PACKED_REFERENCE_ENTRY = 4;                              //Number of words per contig in the table
+const char * const SHARED_REFERENCE_DIR = "/dev/shm";                   //Shared memory of the node (-sr)
+// ---------------------------------------------------------------------------------------
+// Struct PackedReference
+// ---------------------------------------------------------------------------------------
+//Memory-mapped packed reference. The contig table is read from the mapping directly.
+struct PackedReference
+{
+    String<uint64_t, MMap<> > words;
+};
+// ---------------------------------------------------------------------------------------
+// Function getPackedReferencePath()
+// ---------------------------------------------------------------------------------------
+//Return the path of the packed reference belonging to the reference genome.
+inline CharString getPackedReferencePath(const CharString & refFileName)
+{
+    CharString packedFileName = refFileName;
+    append(packedFileName, ".packed");
+    return packedFileName;
+}
+// ---------------------------------------------------------------------------------------
+// Function hasSharedMemory()
+// ---------------------------------------------------------------------------------------
+//Return true if the shared memory of the node is available as a directory, false otherwise.
+inline bool hasSharedMemory()
+{
+    struct stat dirStat;
+    return stat(SHARED_REFERENCE_DIR, &dirStat) == 0 && S_ISDIR(dirStat.st_mode);
+}
+// ---------------------------------------------------------------------------------------
+// Function getPackedReferencePath()
+// ---------------------------------------------------------------------------------------
+//Return the path of the packed reference used with the options. With -sr it lies in the shared memory, named after
+//the reference genome, so that all processes of the node using the same reference find the same copy.
+inline CharString getPackedReferencePath(const ProgramOptions & options)
+{
+    if (!options.sharedReference || !hasSharedMemory())
+        return getPackedReferencePath(options.refPath);
+    CharString packedFileName = SHARED_REFERENCE_DIR;
+    append(packedFileName, "/BAMQC-");
+    append(packedFileName, getCacheFileName(options.refPath, ".packed"));
+    return packedFileName;
+}
+// ---------------------------------------------------------------------------------------
+// Function packBases()
+// ---------------------------------------------------------------------------------------
+//Append the 2-bit codes of seq to packed and the N-runs of seq to nRuns. offset is the position of the first base of
+//seq on the contig and must be a multiple of 32. Runs continuing from the previous call are extended.
+inline void packBases(String<uint64_t> & packed, String<uint64_t> & nRuns, const Dna5String & seq, uint64_t offset)
+{
+    for (unsigned i = 0; i < length(seq); ++i)
+    {
+        uint64_t pos = offset + i;
+        if (pos % 32 == 0)
+            appendValue(packed, 0);
+        unsigned code = ordValue(seq[i]);
+        if (code < 4)
+        {
+            back(packed) |= (uint64_t)code << (2 * (pos % 32));
+        }
+        else if (!empty(nRuns) && back(nRuns) == pos)                  //Extend the last run
+        {
+            ++back(nRuns);
+        }
+        else
+        {
+            appendValue(nRuns, pos);
+            appendValue(nRuns, pos + 1);
+        }
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function buildPackedReference()
+// ---------------------------------------------------------------------------------------
+//Scan the reference genome window-wise and write the packed reference to packedFileName. The file is first written to
+//a temporary file, so that concurrent runs never see an incomplete one. Return false on errors, true otherwise.
+inline bool buildPackedReference(FaiIndex & faiIndex,
+                                 const CharString & refFileName,
+                                 const CharString & packedFileName,
+                                 uint64_t windowSize = 4194304)
+{
+    uint64_t stamp[2];
+    if (!getFileStamp(stamp, refFileName))
+        return false;
+    windowSize = std::max(windowSize / 32 * 32, (uint64_t)32);         //Windows begin at the start of a word
+    CharString tmpFileName = packedFileName;                           //Unique per process, the file may be shared
+    append(tmpFileName, "." + std::to_string(getpid()) + ".tmp");
+    std::ofstream out(toCString(tmpFileName), std::ios_base::out | std::ios_base::binary);
+    if (!out.good())
+        return false;
+    String<uint64_t> header;
+    appendValue(header, PACKED_REFERENCE_MAGIC);
+    appendValue(header, stamp[0]);
+    appendValue(header, stamp[1]);
+    appendValue(header, (uint64_t)numSeqs(faiIndex));
+    resize(header, PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * numSeqs(faiIndex), 0);
+    out.write(reinterpret_cast<const char *>(begin(header, Standard())), length(header) * sizeof(uint64_t));
+    uint64_t offset = length(header);                                   //Words written so far
+    String<uint64_t> packed;
+    String<uint64_t> nRuns;
+    Dna5String window;
+    try
+    {
+        for (unsigned faiId = 0; faiId < numSeqs(faiIndex) && out.good(); ++faiId)
+        {
+            uint64_t contigLength = sequenceLength(faiIndex, faiId);
+            uint64_t * entry = &header[PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * faiId];
+            entry[0] = contigLength;
+            entry[1] = offset;
+            clear(nRuns);
+            for (uint64_t windowBegin = 0; windowBegin < contigLength; windowBegin += windowSize)
+            {
+                readRegion(window, faiIndex, faiId, windowBegin, std::min(windowBegin + windowSize, contigLength));
+                clear(packed);
+                packBases(packed, nRuns, window, windowBegin);
+                out.write(reinterpret_cast<const char *>(begin(packed, Standard())), length(packed) * sizeof(uint64_t));
+                offset += length(packed);
+            }
+            entry[2] = offset;
+            entry[3] = length(nRuns) / 2;
+            out.write(reinterpret_cast<const char *>(begin(nRuns, Standard())), length(nRuns) * sizeof(uint64_t));
+            offset += length(nRuns);
+        }
+        out.seekp(0);                                                   //Contig table is complete now
+        out.write(reinterpret_cast<const char *>(begin(header, Standard())), length(header) * sizeof(uint64_t));
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        out.setstate(std::ios_base::failbit);
+    }
+    out.close();
+    if (out.fail() || std::rename(toCString(tmpFileName), toCString(packedFileName)) != 0)
+    {
+        std::remove(toCString(tmpFileName));
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function openPackedReference()
+// ---------------------------------------------------------------------------------------
+//Map the packed reference into memory. Return false if it is missing, damaged or does not belong to the current
+//version of the reference genome, true otherwise.
+inline bool openPackedReference(PackedReference & packedRef,
+                                const FaiIndex & faiIndex,
+                                const CharString & refFileName,
+                                const CharString & packedFileName)
+{
+    uint64_t stamp[2];
+    uint64_t packedStamp[2];                    //Only checks if the file exists, opening it would print an error
+    if (!getFileStamp(stamp, refFileName) ||
+        !getFileStamp(packedStamp, packedFileName) ||
+        !open(packedRef.words, toCString(packedFileName), OPEN_RDONLY))
+        return false;
+    uint64_t numContigs = numSeqs(faiIndex);
+    const String<uint64_t, MMap<> > & words = packedRef.words;
+    bool ok = length(words) >= PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * numContigs &&
+              words[0] == PACKED_REFERENCE_MAGIC &&
+              words[1] == stamp[0] &&
+              words[2] == stamp[1] &&
+              words[3] == numContigs;
+    uint64_t offset = PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * numContigs;
+    for (unsigned faiId = 0; faiId < numContigs && ok; ++faiId)       //Contigs must follow each other without gaps
+    {
+        const uint64_t * entry = &words[PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * faiId];
+        ok = entry[0] == sequenceLength(faiIndex, faiId) &&
+             entry[1] == offset &&
+             entry[2] == offset + (entry[0] + 31) / 32;
+        offset = entry[2] + 2 * entry[3];
+    }
+    if (!ok || offset != length(words))
+    {
+        close(packedRef.words);
+        return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function preparePackedReference()
+// ---------------------------------------------------------------------------------------
+//Make sure an up-to-date packed reference exists, build it if it is missing or outdated. Called once before the
+//checks start. With -sr the processes of the node using the same reference take turns on a lock file next to the
+//packed reference, so that only the first one builds it and the others wait and find it up-to-date. Return false if
+//it can neither be loaded nor built, true otherwise.
+inline bool preparePackedReference(RefIdxMemory & memory, const ProgramOptions & options)
+{
+    ReferenceIndex faiIndex;
+    if (!loadRefIdx(faiIndex, memory, options))
+        return false;
+    if (options.sharedReference && !hasSharedMemory())
+        std::cerr << "WARNING: Shared memory (" << SHARED_REFERENCE_DIR << ") is not available. Keeping the packed "
+                  << "reference next to the reference genome.\n";
+    CharString packedFileName = getPackedReferencePath(options);
+    int lockFd = -1;
+    if (options.sharedReference)
+    {
+        CharString lockFileName = packedFileName;
+        append(lockFileName, ".lock");
+        lockFd = ::open(toCString(lockFileName), O_RDONLY | O_CREAT, 0666);
+        if (lockFd >= 0 && flock(lockFd, LOCK_EX | LOCK_NB) != 0)
+        {
+            if (options.verbosity)
+                std::cout << "Waiting for packed reference " << packedFileName << "..." << std::endl;
+            while (flock(lockFd, LOCK_EX) != 0 && errno == EINTR);
+        }
+    }
+    PackedReference packedRef;
+    bool loaded = openPackedReference(packedRef, faiIndex, options.refPath, packedFileName);
+    if (!loaded)
+    {
+        if (options.verbosity)
+            std::cout << "Building packed reference " << packedFileName << "..." << std::endl;
+        loaded = buildPackedReference(faiIndex, options.refPath, packedFileName);
+        if (!loaded)
+            std::cerr << "WARNING: Packed reference " << packedFileName << " could not be built. Reading the "
+                      << "reference instead.\n";
+    }
+    if (lockFd >= 0)
+        ::close(lockFd);                                                //Releases the lock
+    return loaded;
+}
+// ---------------------------------------------------------------------------------------
+// Function loadPackedReference()
+// ---------------------------------------------------------------------------------------
+//Map the packed reference prepared by preparePackedReference() if it was requested. Return false if it is not used.
+inline bool loadPackedReference(PackedReference & packedRef,
+                                const FaiIndex & faiIndex,
+                                const ProgramOptions & options)
+{
+    if (!options.packedReference)
+        return false;
+    return openPackedReference(packedRef, faiIndex, options.refPath, getPackedReferencePath(options));
+}
+// ---------------------------------------------------------------------------------------
+// Function findPackedRun()
+// ---------------------------------------------------------------------------------------
+//Return the number of the first N-run of the contig ending behind pos, the number of runs if there is none. Binary
+//search on the runs, which are sorted and disjoint.
+inline uint64_t findPackedRun(const PackedReference & packedRef, unsigned faiId, uint64_t pos)
+{
+    const uint64_t * entry = &packedRef.words[PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * faiId];
+    const uint64_t * runs = &packedRef.words[0] + entry[2];
+    uint64_t lo = 0;
+    uint64_t hi = entry[3];
+    while (lo < hi)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if (runs[2 * mid + 1] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+// ---------------------------------------------------------------------------------------
+// Function getPackedBase()
+// ---------------------------------------------------------------------------------------
+//Return the 2-bit code of the base at pos of the contig, 0 within N-runs.
+inline unsigned getPackedBase(const PackedReference & packedRef, unsigned faiId, uint64_t pos)
+{
+    uint64_t basesBegin = packedRef.words[PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * faiId + 1];
+    return (packedRef.words[basesBegin + pos / 32] >> (2 * (pos % 32))) & 3;
+}
+// ---------------------------------------------------------------------------------------
+// Function readPackedRegion()
+// ---------------------------------------------------------------------------------------
+//Decode the bases [beginPos, endPos) of the contig into seq, same as readRegion() on the FASTA-file.
+inline void readPackedRegion(Dna5String & seq,
+                             const PackedReference & packedRef,
+                             unsigned faiId,
+                             uint64_t beginPos,
+                             uint64_t endPos)
+{
+    resize(seq, endPos - beginPos, Exact());
+    for (uint64_t pos = beginPos; pos < endPos; ++pos)
+        seq[pos - beginPos] = Dna(getPackedBase(packedRef, faiId, pos));
+    const uint64_t * entry = &packedRef.words[PACKED_REFERENCE_HEADER + PACKED_REFERENCE_ENTRY * faiId];
+    const uint64_t * runs = &packedRef.words[0] + entry[2];
+    for (uint64_t r = findPackedRun(packedRef, faiId, beginPos); r < entry[3] && runs[2 * r] < endPos; ++r)
+    {
+        for (uint64_t pos = std::max(runs[2 * r], beginPos); pos < std::min(runs[2 * r + 1], endPos); ++pos)
+            seq[pos - beginPos] = 'N';
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function getPackedContext()
+// ---------------------------------------------------------------------------------------
+//Return whether the triplet starting at pos of the contig is CCG, CGG or anything else. pos + 3 must not exceed the
+//length of the contig. N-runs are packed as A, so they can never be taken for C or G.
+inline ContextType getPackedContext(const PackedReference & packedRef, unsigned faiId, uint64_t pos)
+{
+    if (getPackedBase(packedRef, faiId, pos) != 1 || getPackedBase(packedRef, faiId, pos + 2) != 2)
+        return CONTEXT_OTHER;                                           //Not C?G
+    unsigned middle = getPackedBase(packedRef, faiId, pos + 1);
+    if (middle == 1)
+        return CONTEXT_CCG;
+    if (middle == 2)
+        return CONTEXT_CGG;
+    return CONTEXT_OTHER;
+}
+#endif /* PACKED_REFERENCE_H_ */
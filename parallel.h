@@ -0,0 +1,315 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <seqan/parallel.h>
+#include "metrics.h"
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Region-parallel processing
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Struct Shard
+// ---------------------------------------------------------------------------------------
+//Region [beginPos, endPos) on contig rID processed by one thread at a time.
+struct Shard
+{
+    int32_t rID;
+    int32_t beginPos;
+    int32_t endPos;
+};
+// ---------------------------------------------------------------------------------------
+// Function getShards()
+// ---------------------------------------------------------------------------------------
+//Split all contigs from the header into windows of at most shardSize bases.
+inline void getShards(String<Shard> & shards, BamFileIn & bamFile, int32_t shardSize = 16777216)
+{
+    clear(shards);
+    for (unsigned rID = 0; rID < length(contigLengths(context(bamFile))); ++rID)
+    {
+        int32_t contigLength = contigLengths(context(bamFile))[rID];
+        for (int32_t beginPos = 0; beginPos < contigLength; beginPos += std::min(shardSize, contigLength - beginPos))
+            appendValue(shards, Shard{(int32_t)rID, beginPos, std::min(beginPos + shardSize, contigLength)});
+    }
+}
+// ---------------------------------------------------------------------------------------
+// Function initEngines()
+// ---------------------------------------------------------------------------------------
+//Prepare one engine per thread before the threads start, so that refIdxMemory is only used by this thread. Return
+//false on errors, true otherwise.
+template <typename TEngine>
+inline bool initEngines(std::vector<TEngine> & engines,
+                        const StringSet<CharString> & contigNameStore,
+                        RefIdxMemory & refIdxMemory,
+                        const ProgramOptions & options)
+{
+    for (unsigned t = 0; t < engines.size(); ++t)
+    {
+        if (!initEngine(engines[t], contigNameStore, refIdxMemory, options))
+            return false;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function readShardBatch()
+// ---------------------------------------------------------------------------------------
+//Fill the batch with the next records beginning in the shard. Return true if the batch is full and more records of
+//the shard may follow, false otherwise.
+inline bool readShardBatch(RecordBatch & batch,
+                           BamFileIn & bamFile,
+                           const Shard & shard,
+                           unsigned batchSize,
+                           bool fullRecords)
+{
+    resizeBatch(batch, batchSize, fullRecords);
+    batch.size = 0;
+    while (batch.size < batchSize)
+    {
+        if (atEnd(bamFile))
+            return false;
+        readBatchRecord(batch, bamFile, fullRecords);
+        if (batch.rID[batch.size] != shard.rID || batch.beginPos[batch.size] >= shard.endPos)
+            return false;
+        if (batch.beginPos[batch.size] >= shard.beginPos)          //Otherwise belongs to previous shard
+            ++batch.size;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function processShards()
+// ---------------------------------------------------------------------------------------
+//Worker of one thread. Opens its own handle on the BAM-file and processes shards until none are left.
+//Each record is only counted in the shard its alignment begins in. Sets ok to false on errors.
+template <typename TEngine>
+inline void processShards(TEngine & engine,
+                          bool & ok,
+                          std::atomic<unsigned> & nextShard,
+                          const String<Shard> & shards,
+                          const BamIndex<Bai> & baiIndex,
+                          const ProgramOptions & options,
+                          unsigned batchSize = 1024)
+{
+    BamInput bamInput;
+    BamFileIn bamFile;
+    ok = false;
+    if (!loadBAM(bamFile, bamInput, options))
+        return;
+    RecordBatch batch;
+    try
+    {
+        BamHeader header;
+        readHeader(header, bamFile);
+        for (unsigned s = nextShard++; s < length(shards); s = nextShard++)
+        {
+            const Shard & shard = shards[s];
+            bool hasAlignments = false;
+            if (!jumpToRegion(bamFile, hasAlignments, shard.rID, shard.beginPos, shard.endPos, baiIndex))
+            {
+                std::cerr << "Error: Could not jump to region using the BAM-index." << std::endl;
+                return;
+            }
+            bool more = hasAlignments;
+            while (more)
+            {
+                more = readShardBatch(batch, bamFile, shard, batchSize, needsSequence(engine));
+                consumeBatch(engine, batch, options);
+            }
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        return;
+    }
+    ok = true;
+}
+// ---------------------------------------------------------------------------------------
+// Function wrapProcessParallel()
+// ---------------------------------------------------------------------------------------
+//Wrapper for performing the selected checks with options.threads threads, using the BAM-index to split the genome
+//into shards of shardSize bases. Return false on errors, true otherwise.
+template <typename TEngine>
+inline bool wrapProcessParallel(TEngine & engine,
+                                BamFileIn & bamFile,
+                                const BamIndex<Bai> & baiIndex,
+                                RefIdxMemory & refIdxMemory,
+                                const ProgramOptions & options,
+                                int32_t shardSize = 16777216)
+{
+    std::vector<TEngine> engines(options.threads);
+    if (!initEngines(engines, contigNames(context(bamFile)), refIdxMemory, options))
+        return false;
+    String<Shard> shards;
+    getShards(shards, bamFile, shardSize);
+    std::atomic<unsigned> nextShard(0);
+    std::vector<char> threadOk(options.threads, false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < options.threads; ++t)
+        threads.push_back(std::thread([&, t]()
+        {
+            bool ok = false;
+            processShards(engines[t], ok, nextShard, shards, baiIndex, options);
+            threadOk[t] = ok;
+        }));
+    for (unsigned t = 0; t < options.threads; ++t)
+        threads[t].join();
+    for (unsigned t = 0; t < options.threads; ++t)
+    {
+        if (!threadOk[t])
+            return false;
+        mergeEngine(engine, engines[t]);
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Record pipeline
+// ---------------------------------------------------------------------------------------
+typedef ConcurrentQueue<RecordBatch *, Suspendable<Limit> > TBatchQueue;
+// ---------------------------------------------------------------------------------------
+// Function readBatches()
+// ---------------------------------------------------------------------------------------
+//Reading thread of the pipeline. Takes empty batches from freeBatches, fills them with up to batchSize records and
+//passes them on to the workers via filledBatches. Return false on errors, true otherwise.
+inline bool readBatches(TBatchQueue & filledBatches,
+                        TBatchQueue & freeBatches,
+                        BamFileIn & bamFile,
+                        unsigned batchSize,
+                        bool fullRecords)
+{
+    bool ok = true;
+    RecordBatch * batch = NULL;
+    try
+    {
+        while (!atEnd(bamFile) && popFront(batch, freeBatches))     //Stops if all workers have quit
+        {
+            readBatch(*batch, bamFile, batchSize, fullRecords);
+            appendValue(filledBatches, batch);
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        ok = false;
+    }
+    unlockWriting(filledBatches);                                   //No more batches, let the workers finish
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Function processBatches()
+// ---------------------------------------------------------------------------------------
+//Worker of the pipeline. Processes filled batches until the reader is done and returns them for reuse.
+//Sets ok to false on errors.
+template <typename TEngine>
+inline void processBatches(TEngine & engine,
+                           bool & ok,
+                           TBatchQueue & filledBatches,
+                           TBatchQueue & freeBatches,
+                           const ProgramOptions & options)
+{
+    ok = true;
+    RecordBatch * batch = NULL;
+    try
+    {
+        while (popFront(batch, filledBatches))
+        {
+            consumeBatch(engine, *batch, options);
+            appendValue(freeBatches, batch);
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        ok = false;
+    }
+    unlockWriting(freeBatches);
+}
+// ---------------------------------------------------------------------------------------
+// Function wrapProcessPipeline()
+// ---------------------------------------------------------------------------------------
+//Wrapper for performing the selected checks without BAM-index: The calling thread reads the records in batches while
+//options.threads - 1 workers process them. Only for BAM-files, which leave the contig names of the header untouched
+//while reading. Return false on errors, true otherwise.
+template <typename TEngine>
+inline bool wrapProcessPipeline(TEngine & engine,
+                                BamFileIn & bamFile,
+                                RefIdxMemory & refIdxMemory,
+                                const ProgramOptions & options,
+                                unsigned batchSize = 1024)
+{
+    unsigned numWorkers = std::max(options.threads, 2u) - 1;
+    std::vector<TEngine> engines(numWorkers);
+    if (!initEngines(engines, contigNames(context(bamFile)), refIdxMemory, options))
+        return false;
+    std::vector<RecordBatch> batches(4 * numWorkers);
+    TBatchQueue freeBatches(batches.size());
+    TBatchQueue filledBatches(batches.size());
+    for (unsigned b = 0; b < batches.size(); ++b)
+        appendValue(freeBatches, &batches[b]);
+    setWriterCount(freeBatches, numWorkers);
+    setWriterCount(filledBatches, 1);
+    std::vector<char> threadOk(numWorkers, false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numWorkers; ++t)
+        threads.push_back(std::thread([&, t]()
+        {
+            bool ok = false;
+            processBatches(engines[t], ok, filledBatches, freeBatches, options);
+            threadOk[t] = ok;
+        }));
+    bool ok = readBatches(filledBatches, freeBatches, bamFile, batchSize, needsSequence(engines[0]));
+    for (unsigned t = 0; t < numWorkers; ++t)
+        threads[t].join();
+    for (unsigned t = 0; t < numWorkers && ok; ++t)
+    {
+        ok = threadOk[t];
+        mergeEngine(engine, engines[t]);
+    }
+    return ok;
+}
+// ---------------------------------------------------------------------------------------
+// Function wrapRunChecks()
+// ---------------------------------------------------------------------------------------
+//Perform the checks of TEngine in the processing mode fitting options.threads and the input and write the reports.
+//Return false on errors, true otherwise.
+template <typename TEngine>
+inline bool wrapRunChecks(BamFileIn & bamFile, RefIdxMemory & refIdxMemory, const ProgramOptions & options)
+{
+    TEngine engine;
+    uint64_t allocationsBegin = allocationCounter();
+    bool ok = false;
+    if (options.threads > 1)                                            //Process regions of the genome in parallel
+    {
+        BamIndex<Bai> baiIndex;
+        if (!readsSequentially(options) && loadBAI(baiIndex, options.inPath))
+        {
+            ok = wrapProcessParallel(engine, bamFile, baiIndex, refIdxMemory, options);
+        }
+        else if (isEqual(format(bamFile), Bam()))                       //Overlap reading and processing of records
+        {
+            if (!readsSequentially(options))
+                std::cerr << "WARNING: Could not load BAM-index " << options.inPath << ".bai. Using one thread for "
+                          << "reading.\n";
+            ok = wrapProcessPipeline(engine, bamFile, refIdxMemory, options);
+        }
+        else
+        {
+            std::cerr << "WARNING: Multiple threads require a BAM-file. Using a single thread.\n";
+            ok = wrapProcess(engine, bamFile, refIdxMemory, options);
+        }
+    }
+    else
+    {
+        ok = wrapProcess(engine, bamFile, refIdxMemory, options);       //Perform all selected checks in one run
+    }
+#ifdef BAMQC_ALLOC_STATS
+    reportAllocations(engine, allocationsBegin);
+#else
+    (void)allocationsBegin;
+#endif
+    return ok && writeEngine(engine, options);
+}
+#endif /* PARALLEL_H_ */
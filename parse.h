@@ -5,15 +5,35 @@
 #include <seqan/arg_parse.h>
 #include <seqan/bam_io.h>
 #include <seqan/seq_io.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <sys/stat.h>
+#include "fai_builder.h"
+#include "mapped_file.h"
+#include "prefetch_file.h"
+#include "tee_file.h"
 
 using namespace seqan;
 
 /////////////////////Typedefs////////////////////////
+//Type of all counters. 64 bit, so that deep or merged BAM-files cannot overflow them.
+typedef uint64_t TCount;
 //String holding the number of inserts of each length. Index 1 holds the number
 //of inserts with length 1, index 2 holds the number of inserts with length 2...
 //index 0 holds the number of segments without a mapped partner or the
 //information is not available
-typedef String<unsigned> TInsertDistr;
+typedef String<TCount> TInsertDistr;
+//String holding the number of inserts longer than the maximum insert size in logarithmic buckets. Each power of two is
+//split into 16 buckets, see getTailBucket().
+typedef String<TCount> TInsertTail;
+//Table of conversions. First index: first mate (1) or second mate (0), second index: forward (0) or reverse (1) strand
+typedef TCount TConvTable[2][2];
 
 struct ProgramOptions //Struct holding all program options.
 {
@@ -21,13 +41,45 @@ struct ProgramOptions //Struct holding all program options.
     CharString refPath;
     CharString outPathInserts;
     CharString outPathArtifacts;
+    CharString faiCacheDir;                 //Directory for FAI-indices that cannot be written next to the reference
     bool insDist = false;
     int maxInsert;
     unsigned minMapQ;
     bool conv = false;
+    bool contextIndex = false;              //Look up the reference context in REFERENCE.ctx
+    bool packedReference = false;           //Read the reference from REFERENCE.packed
+    bool sharedReference = false;           //Keep the packed reference in shared memory for all processes
+    bool mdTag = false;                     //Reconstruct the reference context from the MD-tag
     unsigned verbosity = 1;
+    unsigned threads = 1;
+    unsigned decompressThreads = 0;         //0: choose from available cores and number of threads
+    unsigned ioJobs = 8;
+    unsigned prefetch = 0;                  //Reads of the BAM-file kept in flight, 0: memory-map instead
+    bool directIO = false;                  //Read the BAM-file past the page cache
+    bool tee = false;                       //Forward the BAM-file unchanged to standard output
 };
 // ---------------------------------------------------------------------------------------
+// Insert-size tail functions
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Function getTailBucket()
+// ---------------------------------------------------------------------------------------
+//Return the bucket of an insert size of at least 16 in TInsertTail. The width of the buckets is 1/16 of their
+//power of two, i.e. at most 6.25% of the sizes they hold.
+inline unsigned getTailBucket(uint32_t insertSize)
+{
+    unsigned exponent = 31 - __builtin_clz(insertSize);
+    return (exponent - 4) * 16 + ((insertSize >> (exponent - 4)) & 15);
+}
+// ---------------------------------------------------------------------------------------
+// Function getTailBucketBegin()
+// ---------------------------------------------------------------------------------------
+//Return the smallest insert size in the bucket.
+inline uint32_t getTailBucketBegin(unsigned bucket)
+{
+    return (uint32_t)(16 + bucket % 16) << (bucket / 16);
+}
+// ---------------------------------------------------------------------------------------
 // Parsing Functions
 // ---------------------------------------------------------------------------------------
 //Parse the command line and/or display help message.
@@ -45,9 +97,12 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
     ArgParseArgument fileArg(ArgParseArgument::INPUT_FILE, "FILE", false);
     setValidValues(fileArg, "bam sam");
     addArgument(parser, fileArg);
+    addDescription(parser, "BAM_FILE is a BAM- or SAM-file, or - to read either from standard input, e.g. directly "
+                   "behind an aligner.");
 
     addOption(parser, seqan::ArgParseOption(
-    "r", "reference", "Path to reference genome. Required for C>A/G>T-Artifact-check.",
+    "r", "reference", "Path to reference genome. Required for C>A/G>T-Artifact-check. Compressed references must be "
+    "compressed with bgzip, their block index (REFERENCE.gzi) is built if missing.",
     seqan::ArgParseArgument::INPUT_FILE, "IN"));
     setValidValues(parser, "reference",
                    "fasta fa fastq fq fasta.gz fa.gz fastq.gz fq.gz fasta.bz2 fa.bz2 fastq.bz2 fq.bz2");
@@ -60,6 +115,16 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
     "oc", "output-file-conversions", "Path to output file for the C>A/G>T-Artifact-check.",
     seqan::ArgParseArgument::OUTPUT_FILE, "OUT"));
 
+    addOption(parser, seqan::ArgParseOption(
+    "fc", "fai-cache", "Directory for the FAI-index of the reference genome if it cannot be written next to the "
+    "reference, e.g. for a shared read-only reference. Without, such an index is built on each run and kept in memory.",
+    seqan::ArgParseArgument::STRING, "DIR"));
+
+    addOption(parser, seqan::ArgParseOption(
+    "", "tee", "Forward the BAM-file unchanged to standard output while checking it, e.g. to index it in the same "
+    "pipe. Requires output files for the selected checks (-oi, -oc), messages go to standard error. The BAM-file is "
+    "read in a single pass, i.e. a BAM-index is not used."));
+
     addSection(parser, "General Options");
     addOption(parser, seqan::ArgParseOption(
     "mmq", "min-mapq", "Minimum mapping quality.",
@@ -70,6 +135,40 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
 
     addOption(parser, seqan::ArgParseOption("v0", "no-verbosity", "Disable parameter feedback."));
 
+    addSection(parser, "Performance Options");
+    addOption(parser, seqan::ArgParseOption(
+    "t", "threads", "Number of threads. With a BAM-index (BAM_FILE.bai), the genome is split into regions that are "
+    "processed in parallel. Otherwise one thread reads the records and the others process them.",
+    seqan::ArgParseArgument::INTEGER, "INT"));
+    setDefaultValue(parser, "threads", "1");
+    setMinValue(parser, "threads", "1");
+
+    addOption(parser, seqan::ArgParseOption(
+    "dt", "decompress-threads", "Number of BGZF-decompression threads per opened BAM-file. 0 chooses the number from "
+    "the available cores and the number of threads (-t).",
+    seqan::ArgParseArgument::INTEGER, "INT"));
+    setDefaultValue(parser, "decompress-threads", "0");
+    setMinValue(parser, "decompress-threads", "0");
+
+    addOption(parser, seqan::ArgParseOption(
+    "io", "io-jobs", "Number of BGZF-blocks held in flight per decompression thread.",
+    seqan::ArgParseArgument::INTEGER, "INT"));
+    setDefaultValue(parser, "io-jobs", "8");
+    setMinValue(parser, "io-jobs", "1");
+
+    addOption(parser, seqan::ArgParseOption(
+    "pf", "prefetch", "Number of 4 MiB reads of the BAM-file kept in flight ahead of the decompression, using io_uring "
+    "if available and reading threads otherwise. Helps on network filesystems. 0 memory-maps the BAM-file instead. "
+    "With standard input, the number of 4 MiB blocks buffered ahead (at least 2, 4 if 0).",
+    seqan::ArgParseArgument::INTEGER, "INT"));
+    setDefaultValue(parser, "prefetch", "0");
+    setMinValue(parser, "prefetch", "0");
+
+    addOption(parser, seqan::ArgParseOption(
+    "dio", "direct-io", "Read the BAM-file with O_DIRECT past the page cache, so that it does not evict the reference "
+    "genome and its index. Where O_DIRECT is not supported, each part of the BAM-file is dropped from the page cache "
+    "once it has been read. Reads at least 2 blocks ahead (see -pf)."));
+
     addSection(parser, "Insert-size-distribution Options");
     addOption(parser, seqan::ArgParseOption(
               "i", "insert-size-distribution",
@@ -77,7 +176,8 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
               "specified."));
 
     addOption(parser, seqan::ArgParseOption(
-    "m", "max-insert", "Maximum insert size. Sizes above will be ignored.",
+    "m", "max-insert", "Maximum insert size counted exactly. Larger sizes are counted in buckets of at most 6.25% of "
+    "their size.",
     seqan::ArgParseArgument::INTEGER, "INT"));
     setDefaultValue(parser, "max-insert", "1000");
     setMinValue(parser, "max-insert", "100");
@@ -88,6 +188,27 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
               "Perform check for C>A/G>T artifacts induced during sample preparation (Costello et al. (2013)). "
               "Requires reference genome. Output to standard output if -oc with path is not specified."));
 
+    addOption(parser, seqan::ArgParseOption(
+              "ci", "context-index",
+              "Look up CCG and CGG sites in a bitvector index of the reference genome (REFERENCE.ctx) instead of "
+              "reading the reference. The index is built on first use and rebuilt if the reference has changed."));
+
+    addOption(parser, seqan::ArgParseOption(
+              "pr", "packed-reference",
+              "Read the reference genome from a memory-mapped copy with 2 bits per base (REFERENCE.packed) instead of "
+              "the FASTA-file. It is built on first use and rebuilt if the reference has changed."));
+
+    addOption(parser, seqan::ArgParseOption(
+              "sr", "shared-reference",
+              "Keep the packed reference in shared memory (/dev/shm) instead of next to the reference genome. The "
+              "first BAMQC-process on a node builds it, concurrent ones wait for it. All processes map the same copy "
+              "read-only, so that the reference is read and held in memory once per node. Implies -pr."));
+
+    addOption(parser, seqan::ArgParseOption(
+              "md", "md-tag",
+              "Reconstruct the reference context from the read and its MD-tag. The reference genome is then optional "
+              "and only read for alignments without MD-tag, which are skipped if it is not given."));
+
     addTextSection(parser, "Examples");
     addListItem(parser,
             "\\fBBAMQC\\fP \\fBfile.bam\\fP \\fB-i\\fP",
@@ -114,14 +235,42 @@ ArgumentParser::ParseResult parseCommandLine(ProgramOptions & options,
     getOptionValue(options.refPath, parser, "reference");
     getOptionValue(options.outPathInserts, parser, "output-file-inserts");
     getOptionValue(options.outPathArtifacts, parser, "output-file-conversions");
+    getOptionValue(options.faiCacheDir, parser, "fai-cache");
     options.insDist = isSet(parser, "insert-size-distribution");
     getOptionValue(options.maxInsert, parser, "max-insert");
     getOptionValue(options.minMapQ, parser, "min-mapq");
     options.conv = isSet(parser, "conversion-artifact");
+    options.contextIndex = isSet(parser, "context-index");
+    options.packedReference = isSet(parser, "packed-reference");
+    options.sharedReference = isSet(parser, "shared-reference");
+    options.mdTag = isSet(parser, "md-tag");
     options.verbosity = !isSet(parser, "no-verbosity");
+    getOptionValue(options.threads, parser, "threads");
+    getOptionValue(options.decompressThreads, parser, "decompress-threads");
+    getOptionValue(options.ioJobs, parser, "io-jobs");
+    getOptionValue(options.prefetch, parser, "prefetch");
+    options.directIO = isSet(parser, "direct-io");
+    options.tee = isSet(parser, "tee");
     return ArgumentParser::PARSE_OK;
 }
 // ---------------------------------------------------------------------------------------
+// Function readsStdin()
+// ---------------------------------------------------------------------------------------
+//Return true if the BAM-file is read from standard input, false otherwise.
+inline bool readsStdin(const ProgramOptions & options)
+{
+    return options.inPath == "-";
+}
+// ---------------------------------------------------------------------------------------
+// Function readsSequentially()
+// ---------------------------------------------------------------------------------------
+//Return true if the BAM-file can only be read once from begin to end, i.e. from standard input or when forwarding it
+//(--tee), false otherwise.
+inline bool readsSequentially(const ProgramOptions & options)
+{
+    return readsStdin(options) || options.tee;
+}
+// ---------------------------------------------------------------------------------------
 // Function inputCheck()
 // ---------------------------------------------------------------------------------------
 //Check parameters for consistency. Return 1 on inconsistencies and 0 on pass.
@@ -131,18 +280,40 @@ inline int inputCheck(ProgramOptions & options)
         options.insDist = true;
     if (!empty(options.outPathArtifacts))
         options.conv = true;
+    if (options.sharedReference)
+        options.packedReference = true;
     if (!(options.insDist || options.conv))
     {
         std::cerr << "Error: No checks selected. Nothing to be done. Terminating.\n";
         return 1;
     }
     //check if both or none of conversion-flags and reference genome are given.
-    if (options.conv && empty(options.refPath))
+    if (options.conv && empty(options.refPath) && !options.mdTag)
     {
-        std::cerr << "Error: Missing reference genome for C>A/G>T artifact-check. Terminating.\n";
+        std::cerr << "Error: Missing reference genome for C>A/G>T artifact-check (consider using the MD-tag with -md). "
+        "Terminating.\n";
         return 1;
     }
-    else if (!options.conv && !empty(options.refPath))
+    if (options.conv && options.contextIndex && empty(options.refPath))
+    {
+        std::cerr << "Error: Context-index requested, but no reference genome given. Terminating.\n";
+        return 1;
+    }
+    if (options.conv && options.packedReference && empty(options.refPath))
+    {
+        std::cerr << "Error: Packed reference requested, but no reference genome given. Terminating.\n";
+        return 1;
+    }
+    if (options.tee && ((options.insDist && empty(options.outPathInserts)) ||
+                        (options.conv && empty(options.outPathArtifacts))))
+    {
+        std::cerr << "Error: --tee writes the BAM-file to standard output, but a check has no output file (-oi, -oc). "
+        "Terminating.\n";
+        return 1;
+    }
+    if (readsStdin(options) && options.directIO)
+        std::cerr << "WARNING: Direct I/O (-dio) is not possible on standard input. Ignoring it.\n";
+    if (!options.conv && !empty(options.refPath))
     {
         std::cerr << "Error: Reference genome given, but no required (consider setting the -i flag or giving a path "
         "for the output using -oc option). Terminating.\n";
@@ -158,9 +329,11 @@ inline void feedBack(const ProgramOptions & options)
 {
     if (options.verbosity == 0) return;
     std::cout << "Parameters as interpreted:" << std::endl
-              << "BAM-File: " << options.inPath << std::endl;
+              << "BAM-File: " << (readsStdin(options) ? CharString("Standard Input") : options.inPath) << std::endl;
     if (!empty(options.refPath))
         std::cout << "Reference Genome: " << options.refPath << std::endl;
+    if (!empty(options.refPath) && !empty(options.faiCacheDir))
+        std::cout << "FAI-Index Cache: " << options.faiCacheDir << std::endl;
     std::cout << "Determine Insert-Size Distribution: ";
     if (options.insDist)
     {
@@ -184,6 +357,10 @@ inline void feedBack(const ProgramOptions & options)
             std::cout << "Standard Output" <<std::endl;
         else
             std::cout << options.outPathArtifacts << std::endl;
+        std::cout << "Use Context-Index: " << (options.contextIndex ? "Yes" : "No") << std::endl
+                  << "Use Packed Reference: "
+                  << (options.packedReference ? (options.sharedReference ? "Shared Memory" : "Yes") : "No") << std::endl
+                  << "Use MD-Tag: " << (options.mdTag ? "Yes" : "No") << std::endl;
     }
     else
     {
@@ -192,7 +369,20 @@ inline void feedBack(const ProgramOptions & options)
     if (options.insDist)
         std::cout << "Maximum Considered Insert-Size: " << options.maxInsert << std::endl;
     std::cout << "Minimum Mapping-Quality: " << options.minMapQ << std::endl
-              << "Verbosity: " << options.verbosity << std::endl
+              << "Threads: " << options.threads << std::endl
+              << "Decompression Threads: ";
+    if (options.decompressThreads == 0)
+        std::cout << "Auto" << std::endl;
+    else
+        std::cout << options.decompressThreads << std::endl;
+    std::cout << "IO-Jobs per Decompression Thread: " << options.ioJobs << std::endl;
+    if (options.prefetch > 0)
+        std::cout << "Prefetched Reads: " << options.prefetch << std::endl;
+    if (options.directIO)
+        std::cout << "Direct I/O: Yes" << std::endl;
+    if (options.tee)
+        std::cout << "Forward to Standard Output: Yes" << std::endl;
+    std::cout               << "Verbosity: " << options.verbosity << std::endl
               << std::endl
               << "Perfoming selected tasks..." << std::endl
               << std::endl;
@@ -201,37 +391,269 @@ inline void feedBack(const ProgramOptions & options)
 // Input-File functions
 // ---------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------
+// Struct BamInput
+// ---------------------------------------------------------------------------------------
+//Streams underlying a BamFileIn. The BGZF-decompression is set up here instead of inside the BamFileIn to control the
+//size of its thread pool. Must outlive the BamFileIn opened on it.
+struct BamInput
+{
+    PipeFileBuffer pipeFile;                                            //Input from standard input
+    PrefetchFileBuffer prefetchFile;                                    //Compressed input, read ahead (-pf)
+    MappedFileBuffer mappedFile;                                        //Compressed input, memory-mapped
+    std::unique_ptr<std::istream> compressedStream;                     //Stream on one of the buffers above
+    TeeFileBuffer teeFile;                                              //Forwards the compressed input (--tee)
+    std::unique_ptr<std::istream> teeStream;
+    std::ifstream file;                                                 //Compressed input if neither can be used
+    std::unique_ptr<basic_unbgzf_streambuf<char> > bgzfBuffer;          //Decompression thread pool
+    std::unique_ptr<std::istream> stream;                               //Decompressed input
+};
+// ---------------------------------------------------------------------------------------
+// Function getDecompressionThreads()
+// ---------------------------------------------------------------------------------------
+//Return the number of decompression threads per opened BAM-file. If not set by the user, the available cores are
+//shared between the worker threads (-t), each of which opens the BAM-file once.
+inline unsigned getDecompressionThreads(const ProgramOptions & options)
+{
+    if (options.decompressThreads != 0)
+        return options.decompressThreads;
+    unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    if (cores <= options.threads)
+        return 1;
+    return std::min(std::max((cores - options.threads) / options.threads, 1u), 16u);
+}
+// ---------------------------------------------------------------------------------------
 // Function loadBAM()
 // ---------------------------------------------------------------------------------------
-//Load BAM-file. Return false on errors, true otherwise.
-inline bool loadBAM(BamFileIn & bamFile, const CharString & bamFileName)
+//Load BAM-file. Standard input (-) is read ahead by a thread and may hold BAM or SAM. Files are read ahead
+//asynchronously if requested (-pf) or past the page cache (-dio), otherwise from a memory-mapping if possible. All
+//input read is forwarded to standard output if requested (--tee). Return false on errors, true otherwise.
+inline bool loadBAM(BamFileIn & bamFile, BamInput & input, const ProgramOptions & options)
 {
-    if (!open(bamFile, toCString(bamFileName)))
+    try
     {
-        std::cerr << "ERROR: Could not open " << bamFileName << std::endl;
-        return false;
+        std::istream * compressed = &input.file;
+        unsigned prefetch = options.directIO ? std::max(options.prefetch, 2u) : options.prefetch;
+        if (readsStdin(options))
+        {
+            openPipeFile(input.pipeFile, STDIN_FILENO, options.prefetch > 0 ? options.prefetch : 4);
+            input.compressedStream.reset(new std::istream(&input.pipeFile));
+            compressed = input.compressedStream.get();
+        }
+        else if (prefetch > 0 && openPrefetchFile(input.prefetchFile, options.inPath, prefetch, options.directIO))
+        {
+            input.compressedStream.reset(new std::istream(&input.prefetchFile));
+            compressed = input.compressedStream.get();
+        }
+        else if (prefetch == 0 && openMappedFile(input.mappedFile, options.inPath))
+        {
+            input.compressedStream.reset(new std::istream(&input.mappedFile));
+            compressed = input.compressedStream.get();
+        }
+        else
+        {
+            input.file.open(toCString(options.inPath), std::ios_base::in | std::ios_base::binary);
+        }
+        if (options.tee && compressed->good())                          //Forward all bytes read from here on
+        {
+            openTeeFile(input.teeFile, *compressed->rdbuf(), STDOUT_FILENO);
+            input.teeStream.reset(new std::istream(&input.teeFile));
+            compressed = input.teeStream.get();
+        }
+        if (compressed->good() && compressed->peek() == 0x1f)           //BGZF-magic, decompress with own thread pool
+        {
+            input.bgzfBuffer.reset(new basic_unbgzf_streambuf<char>(*compressed,
+                                                                    getDecompressionThreads(options),
+                                                                    options.ioJobs));
+            input.stream.reset(new std::istream(input.bgzfBuffer.get()));
+            if (open(bamFile, *input.stream))
+                return true;
+        }
+        else if (readsSequentially(options) ? compressed->good() && open(bamFile, *compressed)  //Uncompressed SAM
+                                     : open(bamFile, toCString(options.inPath)))
+        {
+            return true;
+        }
     }
-    return true;
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+    }
+    std::cerr << "ERROR: Could not open " << options.inPath << std::endl;
+    return false;
+}
+// ---------------------------------------------------------------------------------------
+// Function closeBAM()
+// ---------------------------------------------------------------------------------------
+//Close BAM-file opened by loadBAM() and forward the rest of the input if requested (--tee). Return false on errors,
+//true otherwise.
+inline bool closeBAM(BamFileIn & bamFile, BamInput & input)
+{
+    close(bamFile);
+    input.stream.reset();
+    input.bgzfBuffer.reset();                                           //Stops the threads still reading ahead
+    return finishTee(input.teeFile);
+}
+// ---------------------------------------------------------------------------------------
+// Function loadBAI()
+// ---------------------------------------------------------------------------------------
+//Load index of BAM-file (BAM_FILE.bai). Return false if it is not available, true otherwise.
+inline bool loadBAI(BamIndex<Bai> & baiIndex, const CharString & bamFileName)
+{
+    CharString baiFileName = bamFileName;
+    append(baiFileName, ".bai");
+    return open(baiIndex, toCString(baiFileName));
+}
+// ---------------------------------------------------------------------------------------
+// Function getCacheFileName()
+// ---------------------------------------------------------------------------------------
+//Return the name of a file with the extension derived from the reference genome, for directories shared by several
+//references. The name holds a hash of the absolute path of the reference, so that references of the same name in
+//different directories do not share a file.
+inline std::string getCacheFileName(const CharString & refFileName, const char * extension)
+{
+    char * absolutePath = realpath(toCString(refFileName), NULL);
+    std::string refPath = absolutePath != NULL ? absolutePath : toCString(refFileName);
+    std::free(absolutePath);
+    std::ostringstream fileName;
+    fileName << refPath.substr(refPath.rfind('/') + 1) << '.' << std::hex << std::hash<std::string>()(refPath)
+             << extension;
+    return fileName.str();
 }
-//Load index of reference genome. If not available, build it on the fly.
-inline bool loadRefIdx(FaiIndex & faiIndex, const CharString & refFileName)
+// ---------------------------------------------------------------------------------------
+// Function getRefIdxCachePath()
+// ---------------------------------------------------------------------------------------
+//Return the path of the index of the reference genome with the extension in the cache directory (-fc), or an empty
+//path if there is none.
+inline CharString getRefIdxCachePath(const ProgramOptions & options, const char * extension = ".fai")
 {
-    if (!open(faiIndex, toCString(refFileName)))
+    CharString cachePath;
+    if (empty(options.faiCacheDir))
+        return cachePath;
+    cachePath = options.faiCacheDir;
+    if (back(cachePath) != '/')
+        appendValue(cachePath, '/');
+    append(cachePath, getCacheFileName(options.refPath, extension));
+    return cachePath;
+}
+// ---------------------------------------------------------------------------------------
+// Function isCacheUpToDate()
+// ---------------------------------------------------------------------------------------
+//Return true if the index cachePath exists and is not older than the reference genome, false otherwise.
+inline bool isCacheUpToDate(const CharString & cachePath, const ProgramOptions & options)
+{
+    struct stat refStat, cacheStat;
+    return !empty(cachePath) && stat(toCString(options.refPath), &refStat) == 0 &&
+           stat(toCString(cachePath), &cacheStat) == 0 && cacheStat.st_mtime >= refStat.st_mtime;
+}
+// ---------------------------------------------------------------------------------------
+// Struct RefIdxMemory
+// ---------------------------------------------------------------------------------------
+//Indices of the reference genome built by loadRefIdx() that could not be saved. Later calls copy them instead of
+//building them again. Owned by main() and passed to every call of loadRefIdx(), which must not run in several threads
+//at once with the same object.
+struct RefIdxMemory
+{
+    FaiIndex faiIndex;
+    BgzfBlockIndex blocks;
+};
+// ---------------------------------------------------------------------------------------
+// Function openRefIdx()
+// ---------------------------------------------------------------------------------------
+//Load FAI-index of reference genome from REFERENCE.fai or the cache directory (-fc), where it is only used if it is
+//not older than the reference. If not available, build it in parallel and save it to the first of both that is
+//writable. If neither is, it is kept in memory for the rest of the run. Return false if it cannot be built, true
+//otherwise.
+inline bool openRefIdx(FaiIndex & faiIndex, RefIdxMemory & memory, const ProgramOptions & options)
+{
+    if (open(faiIndex, toCString(options.refPath)))
+        return true;
+    faiIndex.file.close();                                              //Opened even if the index is missing
+    CharString cachePath = getRefIdxCachePath(options);
+    if (isCacheUpToDate(cachePath, options) && open(faiIndex, toCString(options.refPath), toCString(cachePath)))
+        return true;
+    if (memory.faiIndex.fastaFilename == options.refPath)
+        return copyRefIdx(faiIndex, memory.faiIndex);
+    if (options.verbosity)
+        std::cout << "Building index of reference genome " << options.refPath << "..." << std::endl;
+    CharString faiFileName = options.refPath;
+    append(faiFileName, ".fai");
+    try
     {
-        if (!build(faiIndex, toCString(refFileName)))
+        if (!buildRefIdx(faiIndex, options.refPath, faiFileName, std::max(std::thread::hardware_concurrency(), 1u)))
         {
             std::cerr << "ERROR: Index could not be loaded or built.\n";
             return false;
         }
-        if (!save(faiIndex))
-        {
-            std::cerr << "ERROR: Index could not be written do disk.\n";
-            return false;
-        }
     }
+    catch (Exception const & e)
+    {
+        std::cerr << "Error: "  << e.what() << std::endl;
+        std::cerr << "ERROR: Index could not be loaded or built.\n";
+        return false;
+    }
+    if (save(faiIndex))
+        return true;
+    if (!empty(cachePath) && save(faiIndex, toCString(cachePath)))
+    {
+        faiIndex.faiFilename = cachePath;
+        return true;
+    }
+    std::cerr << "WARNING: Index could not be written to " << faiFileName
+              << (empty(cachePath) ? CharString(" (consider -fc)") : CharString(" or the cache directory"))
+              << ". Keeping it in memory.\n";
+    return copyRefIdx(memory.faiIndex, faiIndex);
+}
+// ---------------------------------------------------------------------------------------
+// Function loadGzi()
+// ---------------------------------------------------------------------------------------
+//Load GZI-index of the BGZF-compressed reference genome from REFERENCE.gzi or the cache directory (-fc). If not
+//available, build it from the block headers and save or keep it like the FAI-index. Return false if it cannot be
+//built, true otherwise.
+inline bool loadGzi(BgzfBlockIndex & blocks, RefIdxMemory & memory, const ProgramOptions & options)
+{
+    CharString gziFileName = options.refPath;
+    append(gziFileName, ".gzi");
+    if (openGzi(blocks, options.refPath, gziFileName))
+        return true;
+    CharString cachePath = getRefIdxCachePath(options, ".gzi");
+    if (isCacheUpToDate(cachePath, options) && openGzi(blocks, options.refPath, cachePath))
+        return true;
+    if (memory.blocks.fileName == options.refPath)
+    {
+        blocks = memory.blocks;
+        return true;
+    }
+    if (!buildGzi(blocks, options.refPath))
+    {
+        std::cerr << "ERROR: GZI-index of " << options.refPath << " could not be built.\n";
+        return false;
+    }
+    if (saveGzi(blocks, gziFileName) || (!empty(cachePath) && saveGzi(blocks, cachePath)))
+        return true;
+    std::cerr << "WARNING: GZI-index could not be written to " << gziFileName
+              << (empty(cachePath) ? CharString(" (consider -fc)") : CharString(" or the cache directory"))
+              << ". Keeping it in memory.\n";
+    memory.blocks = blocks;
     return true;
 }
 // ---------------------------------------------------------------------------------------
+// Function loadRefIdx()
+// ---------------------------------------------------------------------------------------
+//Load index of reference genome (see openRefIdx()). A BGZF-compressed reference is read through its GZI-index (see
+//loadGzi()), keeping the most recently read blocks decompressed. Return false on errors, true otherwise.
+inline bool loadRefIdx(ReferenceIndex & refIndex, RefIdxMemory & memory, const ProgramOptions & options)
+{
+    if (!openRefIdx(refIndex, memory, options))
+        return false;
+    if (!isBgzfFile(options.refPath))
+        return true;
+    BgzfBlockIndex blocks;
+    if (loadGzi(blocks, memory, options) && openBgzfReference(refIndex, blocks))
+        return true;
+    std::cerr << "ERROR: Could not open " << options.refPath << " for reading.\n";
+    return false;
+}
+// ---------------------------------------------------------------------------------------
 // Output-Functions
 // ---------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------
@@ -249,6 +671,8 @@ Pair<unsigned, unsigned> getFirstLast (const TInsertDistr & counts)
             break;
         }
     }
+    if (firstLast.i1 == 0)                                  //No inserts at all
+        return firstLast;
     for(unsigned j = length(counts) - 1; j >= firstLast.i1; --j)
     {
         if (counts[j] != 0)
@@ -260,34 +684,120 @@ Pair<unsigned, unsigned> getFirstLast (const TInsertDistr & counts)
     return firstLast;
 }
 // ---------------------------------------------------------------------------------------
+// Function getInsertValues()
+// ---------------------------------------------------------------------------------------
+//Collect all insert sizes with a non-zero count in ascending order. Tail buckets are represented by their center.
+//Inserts of size 0 (no mapped partner) are left out. Return the total number of inserts.
+inline uint64_t getInsertValues(String<Pair<uint64_t, uint64_t> > & values,
+                                const TInsertDistr & counts,
+                                const TInsertTail & tail)
+{
+    clear(values);
+    uint64_t total = 0;
+    for (unsigned i = 1; i < length(counts); ++i)
+    {
+        if (counts[i] == 0)
+            continue;
+        appendValue(values, Pair<uint64_t, uint64_t>(i, counts[i]));
+        total += counts[i];
+    }
+    for (unsigned b = 0; b < length(tail); ++b)
+    {
+        if (tail[b] == 0)
+            continue;
+        uint64_t first = std::max((uint64_t)getTailBucketBegin(b), (uint64_t)length(counts));
+        uint64_t last = (uint64_t)getTailBucketBegin(b + 1) - 1;
+        appendValue(values, Pair<uint64_t, uint64_t>((first + last) / 2, tail[b]));
+        total += tail[b];
+    }
+    return total;
+}
+// ---------------------------------------------------------------------------------------
+// Function getPercentile()
+// ---------------------------------------------------------------------------------------
+//Return the smallest value for which at least percent % of total lie at or below it (nearest rank).
+//values must be sorted ascending.
+inline uint64_t getPercentile(const String<Pair<uint64_t, uint64_t> > & values, uint64_t total, double percent)
+{
+    uint64_t rank = std::max((uint64_t)std::ceil(percent / 100.0 * total), (uint64_t)1);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < length(values); ++i)
+    {
+        seen += values[i].i2;
+        if (seen >= rank)
+            return values[i].i1;
+    }
+    return 0;
+}
+// ---------------------------------------------------------------------------------------
+// Function formatInsertSummary()
+// ---------------------------------------------------------------------------------------
+//Format median, median absolute deviation and percentiles of the insert sizes as comment lines. The values are exact
+//up to the maximum insert size and rounded to the center of their bucket above.
+inline void formatInsertSummary(std::stringstream & out, const TInsertDistr & counts, const TInsertTail & tail)
+{
+    String<Pair<uint64_t, uint64_t> > values;
+    uint64_t total = getInsertValues(values, counts, tail);
+    if (total == 0)
+        return;
+    uint64_t median = getPercentile(values, total, 50);
+    String<Pair<uint64_t, uint64_t> > deviations;
+    for (unsigned i = 0; i < length(values); ++i)
+    {
+        uint64_t deviation = (values[i].i1 > median) ? values[i].i1 - median : median - values[i].i1;
+        appendValue(deviations, Pair<uint64_t, uint64_t>(deviation, values[i].i2));
+    }
+    std::sort(begin(deviations, Standard()), end(deviations, Standard()));
+    out << "#Inserts: " << total << '\n'
+        << "#Median: " << median << '\n'
+        << "#MAD: " << getPercentile(deviations, total, 50) << '\n';
+    const double percents[] = {1, 5, 25, 75, 95, 99};
+    for (double percent : percents)
+        out << "#Percentile " << percent << ": " << getPercentile(values, total, percent) << '\n';
+}
+// ---------------------------------------------------------------------------------------
 // Function formatStats()
 // ---------------------------------------------------------------------------------------
-//Format the insertSize output.
+//Format the insertSize output. Buckets of the tail are written as ranges FIRST-LAST.
 inline void formatStats(std::stringstream & out,
                         const TInsertDistr & counts,
+                        const TInsertTail & tail,
                         const Pair<unsigned,
                         unsigned> & firstLast)
 {
-    if (firstLast.i1 == 0 && firstLast.i2 == 0)
+    bool emptyTail = true;
+    for (unsigned b = 0; b < length(tail) && emptyTail; ++b)
+        emptyTail = (tail[b] == 0);
+    if (firstLast.i1 == 0 && firstLast.i2 == 0 && emptyTail)
     {
         out << "No valid inserts detected.";
         return;
     }
-    unsigned outputLength = firstLast.i2 - firstLast.i1 + 1;
-    reserve(out, outputLength * 10);
-    for (unsigned i = firstLast.i1; i <= firstLast.i2; ++i)
+    formatInsertSummary(out, counts, tail);
+    if (firstLast.i1 != 0 || firstLast.i2 != 0)
+    {
+        unsigned outputLength = firstLast.i2 - firstLast.i1 + 1;
+        reserve(out, outputLength * 10);
+        for (unsigned i = firstLast.i1; i <= firstLast.i2; ++i)
+        {
+            out << i << '\t' << counts[i] << '\n';
+        }
+    }
+    for (unsigned b = 0; b < length(tail); ++b)
     {
-        out << i << '\t' << counts[i] << '\n';
+        if (tail[b] != 0)
+            out << std::max((uint64_t)getTailBucketBegin(b), (uint64_t)length(counts)) << '-'
+                << (uint64_t)getTailBucketBegin(b + 1) - 1 << '\t' << tail[b] << '\n';
     }
 }
 // ---------------------------------------------------------------------------------------
 // Function formatArtifacts()
 // ---------------------------------------------------------------------------------------
 //Format the conversion artifact output.
-inline void formatArtifacts(std::stringstream & out, unsigned (& artifactConv) [2][2], unsigned (& normalConv) [2][2])
+inline void formatArtifacts(std::stringstream & out, const TConvTable & artifactConv, const TConvTable & normalConv)
 {
-    unsigned hits = artifactConv[0][0] + artifactConv[0][1] + artifactConv[1][0] + artifactConv[1][1];
-    unsigned nonHits = normalConv[0][0] + normalConv[0][1] + normalConv[1][0] + normalConv[1][1];
+    TCount hits = artifactConv[0][0] + artifactConv[0][1] + artifactConv[1][0] + artifactConv[1][1];
+    TCount nonHits = normalConv[0][0] + normalConv[0][1] + normalConv[1][0] + normalConv[1][1];
     out << "Artifact-like Conversions: " << hits << " total" << std::endl
         << "\tForward\tReverse" << std::endl
         << "1st\t" << artifactConv[1][0] << "\t" << artifactConv[1][1] << std::endl
@@ -327,31 +837,4 @@ inline bool writeStats(const std::stringstream & out, const CharString & outPath
     }
     return false;
 }
-// ---------------------------------------------------------------------------------------
-// Function wrapOutputInserts()
-// ---------------------------------------------------------------------------------------
-//Wrapper for calling getFirstLast, formatStats and writeStats (=Wrtingin insert distribution to file)
-inline bool wrapOutputInserts (const TInsertDistr & counts, const ProgramOptions & options)
-{
-    Pair<unsigned, unsigned> firstLast = getFirstLast(counts); //get borders of distribution for clean output
-    std::stringstream out;
-    formatStats(out, counts, firstLast);
-    if (!writeStats(out, options.outPathInserts))
-        return false;
-    else return true;
-}
-// ---------------------------------------------------------------------------------------
-// Function wrapOutputArtifacts()
-// ---------------------------------------------------------------------------------------
-//Wrapper for writing the conversions to file
-inline bool wrapOutputArtifacts (unsigned (& artifactConv) [2][2],
-                                 unsigned (& normalConv) [2][2],
-                                 const ProgramOptions & options)
-{
-    std::stringstream out;
-    formatArtifacts(out, artifactConv, normalConv);
-    if (!writeStats(out, options.outPathArtifacts))
-        return false;
-    else return true;
-}
 #endif /* PARSE_H_ */
\ No newline at end of file
@@ -0,0 +1,631 @@
+#ifndef PREFETCH_FILE_H_
+#define PREFETCH_FILE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BAMQC_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#include <seqan/basic.h>
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Asynchronous read-ahead
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Function preadFully()
+// ---------------------------------------------------------------------------------------
+//Read up to length bytes at offset of the file, retrying short reads. Return the number of bytes read, which is only
+//less than length at the end of the file or after an error, or -1 if nothing could be read.
+inline int64_t preadFully(int fd, char * buffer, uint64_t length, uint64_t offset)
+{
+    uint64_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)                              //E.g. continuing with O_DIRECT behind an unaligned end of file
+            return done > 0 ? (int64_t)done : -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+#ifdef BAMQC_HAS_IO_URING
+// ---------------------------------------------------------------------------------------
+// Struct IoUring
+// ---------------------------------------------------------------------------------------
+//Submission and completion queue of an io_uring instance, used directly through the system calls of the kernel.
+struct IoUring
+{
+    int fd = -1;
+    unsigned * sqTail = NULL;
+    unsigned * sqMask = NULL;
+    unsigned * sqArray = NULL;
+    unsigned * cqHead = NULL;
+    unsigned * cqTail = NULL;
+    unsigned * cqMask = NULL;
+    io_uring_sqe * sqes = NULL;
+    io_uring_cqe * cqes = NULL;
+    void * sqRing = MAP_FAILED;
+    void * cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+};
+// ---------------------------------------------------------------------------------------
+// Function closeIoUring()
+// ---------------------------------------------------------------------------------------
+inline void closeIoUring(IoUring & ring)
+{
+    if (ring.sqes != NULL)
+        munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing)
+        munmap(ring.cqRing, ring.cqRingSize);
+    if (ring.sqRing != MAP_FAILED)
+        munmap(ring.sqRing, ring.sqRingSize);
+    if (ring.fd >= 0)
+        ::close(ring.fd);
+    ring = IoUring();
+}
+// ---------------------------------------------------------------------------------------
+// Function initIoUring()
+// ---------------------------------------------------------------------------------------
+//Set up an io_uring instance for up to entries requests in flight. Return false if io_uring is not available (old
+//kernel, disabled by the system or a sandbox), true otherwise.
+inline bool initIoUring(IoUring & ring, unsigned entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0)
+        return false;
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)                      //Both rings in one mapping
+        ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                       IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED)
+    {
+        closeIoUring(ring);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cqRing = ring.sqRing;
+    else
+        ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_CQ_RING);
+    ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void * sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                       IORING_OFF_SQES);
+    if (sqes != MAP_FAILED)
+        ring.sqes = static_cast<io_uring_sqe *>(sqes);
+    if (ring.cqRing == MAP_FAILED || ring.sqes == NULL)
+    {
+        closeIoUring(ring);
+        return false;
+    }
+    char * sq = static_cast<char *>(ring.sqRing);
+    char * cq = static_cast<char *>(ring.cqRing);
+    ring.sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring.cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Function submitRead()
+// ---------------------------------------------------------------------------------------
+//Submit a read of iov from offset of the file fd, tagged with userData. iov must stay valid until the read completed.
+//Return false on errors, true otherwise.
+inline bool submitRead(IoUring & ring, int fd, const iovec & iov, uint64_t offset, uint64_t userData)
+{
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & *ring.sqMask;
+    io_uring_sqe & sqe = ring.sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(&iov);
+    sqe.len = 1;
+    sqe.off = offset;
+    sqe.user_data = userData;
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    int submitted = -1;
+    do
+        submitted = syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0);
+    while (submitted < 0 && errno == EINTR);
+    if (submitted == 1)
+        return true;
+    __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);             //Not consumed by the kernel, take it back
+    return false;
+}
+// ---------------------------------------------------------------------------------------
+// Function waitCompletion()
+// ---------------------------------------------------------------------------------------
+//Wait for the next completed read and return its userData and result (bytes read or -errno).
+//Return false on errors, true otherwise.
+inline bool waitCompletion(IoUring & ring, uint64_t & userData, int & result)
+{
+    while (true)
+    {
+        unsigned head = *ring.cqHead;
+        if (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe & cqe = ring.cqes[head & *ring.cqMask];
+            userData = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return false;
+    }
+}
+#endif
+// ---------------------------------------------------------------------------------------
+// Struct PrefetchSlot
+// ---------------------------------------------------------------------------------------
+//Buffer for one block of the file and the state of its read.
+struct PrefetchSlot
+{
+    std::vector<char> storage;
+    char * data = NULL;                         //Begin of the block in storage, aligned for O_DIRECT
+    uint64_t block = 0;                         //Number of the block held or requested
+    uint64_t length = 0;                        //Bytes requested, after the read the bytes actually read
+    bool ready = true;                          //No read pending
+#ifdef BAMQC_HAS_IO_URING
+    iovec iov;
+#endif
+};
+// ---------------------------------------------------------------------------------------
+// Class PrefetchFileBuffer
+// ---------------------------------------------------------------------------------------
+//Read-only stream buffer keeping depth reads of blockSize bytes in flight ahead of the reading position, so that the
+//reader only waits if the storage cannot keep up on average. Reads are issued via io_uring if available, otherwise
+//by depth threads using pread(). Seeking drops all blocks read ahead and starts over at the new position.
+//In direct mode the file is read with O_DIRECT past the page cache. Where the filesystem does not support O_DIRECT,
+//each block is dropped from the page cache once it has been consumed instead.
+class PrefetchFileBuffer : public std::streambuf
+{
+public:
+    int fd = -1;
+    uint64_t size = 0;                          //Length of the file
+    uint64_t blockSize = 4194304;
+    bool allowIoUring = true;                   //Use pread()-threads even if io_uring is available if false
+    bool useIoUring = false;
+    bool direct = false;                        //Opened with O_DIRECT, reads are aligned to alignment
+    bool dropCache = false;                     //Drop consumed blocks from the page cache
+    uint64_t alignment = 4096;                  //Of offsets, lengths and buffers with O_DIRECT
+    std::vector<PrefetchSlot> slots;            //Block b is held by slot b % depth
+    uint64_t currentBlock = 0;                  //Block in the get area
+    unsigned inFlight = 0;                      //Number of reads requested but not finished yet
+#ifdef BAMQC_HAS_IO_URING
+    IoUring ring;
+#endif
+    std::vector<std::thread> threads;           //pread()-threads
+    std::mutex mutex;
+    std::condition_variable requested;
+    std::condition_variable finished;
+    std::deque<unsigned> queue;                 //Slots to read by the threads
+    bool stop = false;
+
+    PrefetchFileBuffer() {}
+    PrefetchFileBuffer(const PrefetchFileBuffer &) = delete;
+    PrefetchFileBuffer & operator=(const PrefetchFileBuffer &) = delete;
+
+    ~PrefetchFileBuffer()
+    {
+        if (fd < 0)
+            return;
+        drain();
+        release(currentBlock);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        requested.notify_all();
+        for (unsigned t = 0; t < threads.size(); ++t)
+            threads[t].join();
+#ifdef BAMQC_HAS_IO_URING
+        closeIoUring(ring);
+#endif
+        ::close(fd);
+    }
+
+    //Read requests of the pread()-threads until stop is set.
+    void readRequests()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            requested.wait(lock, [&]() {return stop || !queue.empty();});
+            if (queue.empty())
+                return;
+            PrefetchSlot & slot = slots[queue.front()];
+            queue.pop_front();
+            lock.unlock();
+            int64_t n = preadFully(fd, slot.data, slot.length, slot.block * blockSize);
+            lock.lock();
+            slot.length = std::max(n, (int64_t)0);
+            slot.ready = true;
+            --inFlight;
+            finished.notify_all();
+        }
+    }
+
+    //Return the number of bytes to read for block: up to the end of the file, rounded up to the alignment with
+    //O_DIRECT. Reads behind the end of the file just come back short.
+    uint64_t readLength(uint64_t block)
+    {
+        uint64_t length = std::min(blockSize, size - block * blockSize);
+        if (direct)
+            length = (length + alignment - 1) / alignment * alignment;
+        return length;
+    }
+
+    //Drop block from the page cache if requested, it is not read again.
+    void release(uint64_t block)
+    {
+        if (dropCache && block * blockSize < size)
+            posix_fadvise(fd, block * blockSize, blockSize, POSIX_FADV_DONTNEED);
+    }
+
+    //Request block into its slot, nothing if it lies behind the end of the file.
+    void request(uint64_t block)
+    {
+        if (block * blockSize >= size)
+            return;
+        unsigned s = block % slots.size();
+        PrefetchSlot & slot = slots[s];
+        slot.block = block;
+        slot.length = readLength(block);
+        slot.ready = false;
+#ifdef BAMQC_HAS_IO_URING
+        if (useIoUring)
+        {
+            slot.iov.iov_base = slot.data;
+            slot.iov.iov_len = slot.length;
+            if (submitRead(ring, fd, slot.iov, block * blockSize, s))
+                ++inFlight;
+            else
+                finish(slot, -1);                                       //Read synchronously
+            return;
+        }
+#endif
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(s);
+            ++inFlight;
+        }
+        requested.notify_one();
+    }
+
+    //Complete a read finished by io_uring with result bytes read or -errno. Short reads and failed reads are finished
+    //synchronously.
+    void finish(PrefetchSlot & slot, int result)
+    {
+        uint64_t done = std::max(result, 0);
+        if (done < slot.length)
+        {
+            int64_t n = preadFully(fd, slot.data + done, slot.length - done, slot.block * blockSize + done);
+            done += std::max(n, (int64_t)0);
+        }
+        slot.length = done;
+        slot.ready = true;
+    }
+
+    //Wait until the read into slot has finished.
+    void wait(PrefetchSlot & slot)
+    {
+#ifdef BAMQC_HAS_IO_URING
+        if (useIoUring)
+        {
+            while (!slot.ready)
+            {
+                uint64_t s = 0;
+                int result = -1;
+                if (!waitCompletion(ring, s, result))
+                {
+                    useIoUring = false;                                 //Only happens if the ring breaks down
+                    finish(slot, -1);
+                    return;
+                }
+                --inFlight;
+                finish(slots[s], result);
+            }
+            return;
+        }
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() {return slot.ready;});
+    }
+
+    //Wait for all reads in flight.
+    void drain()
+    {
+#ifdef BAMQC_HAS_IO_URING
+        if (useIoUring)
+        {
+            for (unsigned s = 0; s < slots.size() && inFlight > 0; ++s)
+                wait(slots[s]);
+            return;
+        }
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() {return inFlight == 0;});
+    }
+
+    //Drop the blocks read ahead and continue reading at pos.
+    void restart(uint64_t pos)
+    {
+        drain();
+        release(currentBlock);
+        currentBlock = pos / blockSize;
+        for (unsigned k = 0; k < slots.size(); ++k)
+            request(currentBlock + k);
+        if (pos >= size)
+        {
+            setg(NULL, NULL, NULL);
+            return;
+        }
+        PrefetchSlot & slot = slots[currentBlock % slots.size()];
+        wait(slot);
+        char * data = slot.data;
+        setg(data, data + std::min(pos - currentBlock * blockSize, slot.length), data + slot.length);
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        if ((currentBlock + 1) * blockSize >= size)
+            return traits_type::eof();
+        release(currentBlock);
+        request(currentBlock + slots.size());                          //Reuse the slot of the finished block
+        ++currentBlock;
+        PrefetchSlot & slot = slots[currentBlock % slots.size()];
+        wait(slot);
+        char * data = slot.data;
+        setg(data, data, data + slot.length);
+        if (slot.length == 0)                                           //Read error
+            return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which & std::ios_base::in) || fd < 0)
+            return pos_type(off_type(-1));
+        off_type current = currentBlock * blockSize + (gptr() - eback());
+        off_type pos = off;
+        if (dir == std::ios_base::cur)
+            pos += current;
+        else if (dir == std::ios_base::end)
+            pos += size;
+        if (pos < 0 || (uint64_t)pos > size)
+            return pos_type(off_type(-1));
+        if ((uint64_t)pos / blockSize == currentBlock && eback() != NULL &&
+            (uint64_t)pos - currentBlock * blockSize < (uint64_t)(egptr() - eback()))
+            setg(eback(), eback() + (pos - currentBlock * blockSize), egptr());     //Within the current block
+        else
+            restart(pos);
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Function openPrefetchFile()
+// ---------------------------------------------------------------------------------------
+//Open the regular file fileName and start reading ahead depth blocks. If direct is set, the file is read past the
+//page cache (see PrefetchFileBuffer). Return false if it cannot be opened, true otherwise.
+inline bool openPrefetchFile(PrefetchFileBuffer & buffer,
+                             const CharString & fileName,
+                             unsigned depth,
+                             bool direct = false)
+{
+    struct stat fileStat;
+#ifdef O_DIRECT
+    if (direct)
+        buffer.fd = ::open(toCString(fileName), O_RDONLY | O_DIRECT);
+#endif
+    buffer.direct = buffer.fd >= 0;
+    buffer.dropCache = direct && !buffer.direct;                        //E.g. tmpfs does not support O_DIRECT
+    if (buffer.fd < 0)
+        buffer.fd = ::open(toCString(fileName), O_RDONLY);
+    if (buffer.fd < 0)
+        return false;
+    if (fstat(buffer.fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+    {
+        ::close(buffer.fd);
+        buffer.fd = -1;
+        return false;
+    }
+    buffer.size = fileStat.st_size;
+    if (buffer.direct)
+        buffer.blockSize = (buffer.blockSize + buffer.alignment - 1) / buffer.alignment * buffer.alignment;
+    buffer.slots.resize(std::max(depth, 1u));
+    for (unsigned s = 0; s < buffer.slots.size(); ++s)
+    {
+        PrefetchSlot & slot = buffer.slots[s];
+        slot.storage.resize(buffer.blockSize + buffer.alignment);
+        uintptr_t address = reinterpret_cast<uintptr_t>(&slot.storage[0]);
+        slot.data = &slot.storage[0] + (buffer.alignment - address % buffer.alignment) % buffer.alignment;
+    }
+#ifdef BAMQC_HAS_IO_URING
+    buffer.useIoUring = buffer.allowIoUring && initIoUring(buffer.ring, buffer.slots.size());
+#endif
+    if (!buffer.useIoUring)
+    {
+        for (unsigned t = 0; t < buffer.slots.size(); ++t)
+            buffer.threads.push_back(std::thread([&buffer]() {buffer.readRequests();}));
+    }
+    posix_fadvise(buffer.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    buffer.restart(0);
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Class PipeFileBuffer
+// ---------------------------------------------------------------------------------------
+//Read-only stream buffer on a pipe or other non-seekable file descriptor, e.g. standard input behind an aligner. A
+//reading thread drains the pipe into up to depth blocks of blockSize bytes ahead of the reader, so that the writer
+//is not held up while the reader is busy. Seeking is not supported.
+class PipeFileBuffer : public std::streambuf
+{
+public:
+    int fd = -1;
+    uint64_t blockSize = 4194304;
+    std::vector<PrefetchSlot> slots;            //Filled in turn, a length of 0 marks the end of the input
+    unsigned current = 0;                       //Slot in the get area
+    unsigned filled = 0;                        //Number of slots filled but not consumed yet
+    bool atEnd = false;                         //Reader has reached the slot marking the end
+    std::atomic<bool> stop;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable filledSlot;
+    std::condition_variable freedSlot;
+
+    PipeFileBuffer() : stop(false) {}
+    PipeFileBuffer(const PipeFileBuffer &) = delete;
+    PipeFileBuffer & operator=(const PipeFileBuffer &) = delete;
+
+    ~PipeFileBuffer()
+    {
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        freedSlot.notify_all();
+        thread.join();
+    }
+
+    //Read up to blockSize bytes into data, waiting for the writer if needed. Return the number of bytes read, which is
+    //only less than blockSize at the end of the input, or -1 on errors or if stop is set while waiting.
+    int64_t readBlock(char * data)
+    {
+        uint64_t done = 0;
+        while (done < blockSize)
+        {
+            pollfd ready = {fd, POLLIN, 0};
+            int polled = poll(&ready, 1, 100);                         //Wake up regularly to check stop
+            if (stop)
+                return -1;
+            if (polled < 0 && errno != EINTR)
+                return -1;
+            if (polled <= 0)
+                continue;
+            ssize_t n = ::read(fd, data + done, blockSize - done);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (n < 0)
+            {
+                std::cerr << "Error: Could not read input: " << std::strerror(errno) << std::endl;
+                return -1;
+            }
+            if (n == 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+    //Reading thread: fill the slots in turn until the end of the input or until stop is set.
+    void readBlocks()
+    {
+        for (unsigned s = 0; ; s = (s + 1) % slots.size())
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                freedSlot.wait(lock, [&]() {return stop || filled < slots.size();});
+                if (stop)
+                    return;
+            }
+            int64_t n = readBlock(slots[s].data);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots[s].length = std::max(n, (int64_t)0);
+                ++filled;
+            }
+            filledSlot.notify_one();
+            if (n <= 0)
+                return;
+        }
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        if (atEnd)
+            return traits_type::eof();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (eback() != NULL)                                            //Hand the consumed slot back
+        {
+            --filled;
+            current = (current + 1) % slots.size();
+            freedSlot.notify_one();
+        }
+        filledSlot.wait(lock, [&]() {return filled > 0;});
+        PrefetchSlot & slot = slots[current];
+        if (slot.length == 0)
+        {
+            atEnd = true;
+            setg(NULL, NULL, NULL);
+            return traits_type::eof();
+        }
+        setg(slot.data, slot.data, slot.data + slot.length);
+        return traits_type::to_int_type(*gptr());
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Function openPipeFile()
+// ---------------------------------------------------------------------------------------
+//Start reading ahead up to depth blocks from the open file descriptor fd, e.g. STDIN_FILENO. The descriptor is not
+//closed by the buffer.
+inline void openPipeFile(PipeFileBuffer & buffer, int fd, unsigned depth)
+{
+    buffer.fd = fd;
+    buffer.slots.resize(std::max(depth, 2u));                           //One for the reader, one for the thread
+    for (unsigned s = 0; s < buffer.slots.size(); ++s)
+    {
+        buffer.slots[s].storage.resize(buffer.blockSize);
+        buffer.slots[s].data = &buffer.slots[s].storage[0];
+    }
+    buffer.thread = std::thread([&buffer]() {buffer.readBlocks();});
+}
+#endif /* PREFETCH_FILE_H_ */
@@ -0,0 +1,172 @@
+#ifndef TEE_FILE_H_
+#define TEE_FILE_H_
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <seqan/parallel.h>
+
+using namespace seqan;
+
+// ---------------------------------------------------------------------------------------
+// Forwarding of the input
+// ---------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------
+// Struct TeeBlock
+// ---------------------------------------------------------------------------------------
+//Block of raw input passed from the reader to the writing thread.
+struct TeeBlock
+{
+    std::vector<char> data;
+    uint64_t length = 0;
+};
+typedef ConcurrentQueue<TeeBlock *, Suspendable<Limit> > TTeeQueue;
+// ---------------------------------------------------------------------------------------
+// Function writeFully()
+// ---------------------------------------------------------------------------------------
+//Write length bytes to the file descriptor fd, retrying short writes. Return false on errors, true otherwise.
+inline bool writeFully(int fd, const char * data, uint64_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = ::write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+// ---------------------------------------------------------------------------------------
+// Class TeeFileBuffer
+// ---------------------------------------------------------------------------------------
+//Read-only stream buffer passing the bytes of a source buffer through unchanged, while a writing thread forwards the
+//same bytes to the file descriptor fd. Blocks are read from the source into one of a fixed number of blocks, which
+//is handed to the writing thread once it has been consumed. If the writing thread falls behind, reading waits for
+//it to return a block, so a slow consumer of the output slows down the reader instead of filling the memory.
+//Seeking is not supported.
+class TeeFileBuffer : public std::streambuf
+{
+public:
+    std::streambuf * source = NULL;
+    int fd = -1;
+    uint64_t blockSize = 4194304;
+    std::vector<TeeBlock> blocks;
+    std::unique_ptr<TTeeQueue> freeBlocks;
+    std::unique_ptr<TTeeQueue> filledBlocks;
+    TeeBlock * current = NULL;                  //Block in the get area
+    std::thread writer;
+    bool ok = true;                             //Set to false by the writing thread if writing failed
+
+    TeeFileBuffer() {}
+    TeeFileBuffer(const TeeFileBuffer &) = delete;
+    TeeFileBuffer & operator=(const TeeFileBuffer &) = delete;
+
+    ~TeeFileBuffer()
+    {
+        if (!writer.joinable())
+            return;
+        unlockWriting(*filledBlocks);                                   //Write what has been passed on so far
+        writer.join();
+    }
+
+    //Writing thread: write the filled blocks in order and return them for reuse until the reader is done. After an
+    //error the blocks are still returned, so that the reader does not wait forever.
+    void writeBlocks()
+    {
+        TeeBlock * block = NULL;
+        while (popFront(block, *filledBlocks))
+        {
+            if (ok && !writeFully(fd, &block->data[0], block->length))
+            {
+                std::cerr << "Error: Could not forward the input: " << std::strerror(errno) << std::endl;
+                ok = false;
+            }
+            appendValue(*freeBlocks, block);
+        }
+        unlockWriting(*freeBlocks);
+    }
+
+    //Pass the current block on to the writing thread.
+    void forward()
+    {
+        if (current == NULL)
+            return;
+        if (current->length > 0)
+            appendValue(*filledBlocks, current);
+        else
+            appendValue(*freeBlocks, current);
+        current = NULL;
+        setg(NULL, NULL, NULL);
+    }
+
+    //Read the next block from the source into a free block. Return false at the end of the source, true otherwise.
+    bool fill()
+    {
+        if (!popFront(current, *freeBlocks))
+        {
+            current = NULL;
+            return false;
+        }
+        current->length = source->sgetn(&current->data[0], blockSize);
+        return current->length > 0;
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        forward();
+        if (!fill())
+            return traits_type::eof();
+        char * data = &current->data[0];
+        setg(data, data, data + current->length);
+        return traits_type::to_int_type(*gptr());
+    }
+};
+// ---------------------------------------------------------------------------------------
+// Function openTeeFile()
+// ---------------------------------------------------------------------------------------
+//Pass the bytes of source through buffer and forward them to the file descriptor fd, holding at most depth blocks.
+inline void openTeeFile(TeeFileBuffer & buffer, std::streambuf & source, int fd, unsigned depth = 4)
+{
+    buffer.source = &source;
+    buffer.fd = fd;
+    buffer.blocks.resize(std::max(depth, 2u));
+    buffer.freeBlocks.reset(new TTeeQueue(buffer.blocks.size()));
+    buffer.filledBlocks.reset(new TTeeQueue(buffer.blocks.size()));
+    for (unsigned b = 0; b < buffer.blocks.size(); ++b)
+    {
+        buffer.blocks[b].data.resize(buffer.blockSize);
+        appendValue(*buffer.freeBlocks, &buffer.blocks[b]);
+    }
+    setWriterCount(*buffer.freeBlocks, 1);
+    setWriterCount(*buffer.filledBlocks, 1);
+    buffer.writer = std::thread([&buffer]() {buffer.writeBlocks();});
+}
+// ---------------------------------------------------------------------------------------
+// Function finishTee()
+// ---------------------------------------------------------------------------------------
+//Forward the rest of the source, including bytes read but not consumed, and wait until everything is written.
+//Nothing to be done if buffer was not opened. Return false on errors, true otherwise.
+inline bool finishTee(TeeFileBuffer & buffer)
+{
+    if (!buffer.writer.joinable())
+        return true;
+    buffer.forward();
+    while (buffer.fill())
+        buffer.forward();
+    buffer.forward();
+    unlockWriting(*buffer.filledBlocks);
+    buffer.writer.join();
+    return buffer.ok;
+}
+#endif /* TEE_FILE_H_ */